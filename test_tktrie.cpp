@@ -6,9 +6,14 @@
 #include <atomic>
 #include <random>
 #include <map>
+#include <set>
+#include <span>
+#include <memory>
+#include <memory_resource>
 #include <unordered_map>
 #include <shared_mutex>
 #include <algorithm>
+#include <bit>
 #include "tktrie.h"
 
 // ~1000 common English words
@@ -188,6 +193,22 @@ double bench_find(Container& c, const Keys& keys, int threads, int ms) {
     return ops.load() * 1000.0 / ms;
 }
 
+template<typename Trie, typename Keys>
+double bench_find_batched(const Trie& t, const Keys& keys, size_t batch, int ms) {
+    using K = typename Keys::value_type;
+    std::unique_ptr<bool[]> found(new bool[batch]);
+    uint64_t ops = 0;
+    size_t i = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while (std::chrono::steady_clock::now() < deadline) {
+        size_t n = std::min(batch, keys.size() - i);
+        t.contains_many(std::span<const K>(keys.data() + i, n), std::span<bool>(found.get(), n));
+        ops += n;
+        i = (i + n) % keys.size();
+    }
+    return ops * 1000.0 / ms;
+}
+
 template<typename Container, typename Keys, typename V>
 double bench_insert(const Keys& keys, int threads, int ms) {
     std::atomic<bool> running{true};
@@ -312,6 +333,412 @@ void test_signed_ordering() {
         if (!t.contains(v)) all_found = false;
     }
     std::cout << "\nAll values found: " << (all_found ? "YES" : "NO") << "\n\n";
+    
+    std::vector<int> forward, backward;
+    for (auto it = t.begin(); it != t.end(); ++it) forward.push_back(it.key());
+    for (auto it = t.end(); it != t.begin();) backward.push_back((--it).key());
+    std::reverse(backward.begin(), backward.end());
+    
+    std::cout << "In-order iteration:";
+    for (auto v : forward) std::cout << " " << v;
+    std::cout << "\n\nIteration sorted both ways: " << (forward == vals && backward == vals ? "YES" : "NO") << "\n\n";
+    
+    std::vector<int> window;
+    t.scan(-100, 100, [&](int k, const std::string&) { window.push_back(k); });
+    std::cout << "lower_bound(-50) = " << t.lower_bound(-50).key()
+              << ", upper_bound(1) = " << t.upper_bound(1).key() << "\n";
+    std::cout << "scan [-100, 100):";
+    for (auto v : window) std::cout << " " << v;
+    std::cout << "\n\n";
+}
+
+void test_string_prefixes() {
+    std::cout << "## String Prefix Test\n\n";
+    
+    gteitelbaum::tktrie<std::string, int> t;
+    for (size_t i = 0; i < STRING_KEYS.size(); i++) t.insert({STRING_KEYS[i], (int)i});
+    
+    std::set<std::string> ref(STRING_KEYS.begin(), STRING_KEYS.end());
+    size_t expected = 0;
+    for (auto it = ref.lower_bound("inter"); it != ref.end() && it->rfind("inter", 0) == 0; ++it) expected++;
+    std::cout << "count_prefix(\"inter\") = " << t.count_prefix("inter") << " (expected " << expected << ")\n";
+    
+    std::cout << "for_each_prefix(\"disc\"):";
+    t.for_each_prefix("disc", [](const std::string& k, int) { std::cout << " " << k; });
+    std::cout << "\n\nLongest prefix match:\n";
+    for (std::string q : {"internationally/v2", "interoperable", "thermostat", "zzz"}) {
+        auto it = t.longest_prefix_match(q);
+        std::cout << "  " << q << " -> " << (it.valid() ? it.key() : "NOT FOUND") << "\n";
+    }
+    std::cout << "\n";
+}
+
+// Lookups and erases that take a std::string_view, a const char* or a type
+// convertible to std::string_view instead of building a std::string
+void test_transparent_lookup() {
+    std::cout << "## Transparent Lookup Test\n\n";
+
+    gteitelbaum::tktrie<std::string, int> t;
+    for (size_t i = 0; i < STRING_KEYS.size(); i++) t.insert({STRING_KEYS[i], (int)i});
+
+    struct Name {
+        std::string text;
+        operator std::string_view() const { return text; }
+    };
+    std::string_view hit = "international", miss = "internationalist";
+    auto it = t.find(hit);
+    bool view_ok = it != t.end() && it.key() == hit && t.contains(hit) && t.find(miss) == t.end() && !t.contains(miss);
+    bool literal_ok = t.contains("government") && t.find("government") != t.end() && !t.contains("governments");
+    bool convertible_ok = t.contains(Name{"family"}) && !t.contains(Name{"families"});
+    std::cout << "string_view hit and miss: " << (view_ok ? "YES" : "NO") << "\n";
+    std::cout << "const char* hit and miss: " << (literal_ok ? "YES" : "NO") << "\n";
+    std::cout << "convertible type hit and miss: " << (convertible_ok ? "YES" : "NO") << "\n";
+
+    size_t before = t.size();
+    bool erased = t.erase(hit) && !t.erase(miss);
+    std::cout << "string_view erase: " << (erased && t.size() == before - 1 && !t.contains(hit) ? "YES" : "NO") << "\n\n";
+}
+
+// first_mismatch against a bytewise scan at the lengths where it switches
+// between 4-, 8-, 16- and 32-byte blocks and their overlapping last block,
+// with the mismatch at every position and with none
+void test_first_mismatch() {
+    std::cout << "## First Mismatch Test\n\n";
+
+    bool ok = true;
+    for (size_t n : {0, 1, 3, 4, 5, 7, 8, 9, 12, 15, 16, 17, 20, 24, 31, 32, 33, 40, 47, 48, 63, 64, 65}) {
+        for (size_t at = 0; at <= n; at++) {
+            std::string a(n + 1, 'x'), b = a;   // one byte past n that always differs
+            b[n] = 'y';
+            if (at < n) b[at] = 'y';
+            size_t expected = 0;
+            while (expected < n && a[expected] == b[expected]) expected++;
+            ok &= gteitelbaum::first_mismatch(a.data(), b.data(), n) == expected;
+        }
+    }
+    std::cout << "matches bytewise scan: " << (ok ? "YES" : "NO") << "\n\n";
+}
+
+void test_bulk_load() {
+    std::cout << "## Bulk Load Test\n\n";
+    
+    std::map<uint64_t, int> sorted;
+    for (size_t i = 0; i < UINT64_KEYS.size(); i++) sorted.insert({UINT64_KEYS[i], (int)i});
+    
+    auto t0 = std::chrono::steady_clock::now();
+    gteitelbaum::tktrie<uint64_t, int> bulk(sorted.begin(), sorted.end());
+    auto t1 = std::chrono::steady_clock::now();
+    gteitelbaum::tktrie<uint64_t, int> inserted;
+    for (auto& kv : sorted) inserted.insert(kv);
+    auto t2 = std::chrono::steady_clock::now();
+    
+    bool same = bulk.size() == inserted.size() &&
+                std::equal(bulk.begin(), bulk.end(), inserted.begin(), inserted.end());
+    printf("Loaded %zu keys: bulk_load %.2fms, insert %.2fms\n", bulk.size(),
+           std::chrono::duration<double, std::milli>(t1 - t0).count(),
+           std::chrono::duration<double, std::milli>(t2 - t1).count());
+    std::cout << "Contents match insert: " << (same ? "YES" : "NO") << "\n\n";
+}
+
+void test_pmr_allocator() {
+    std::cout << "## Allocator Test\n\n";
+    
+    std::pmr::monotonic_buffer_resource pool;
+    size_t found = 0;
+    {
+        gteitelbaum::tktrie<std::string, int, std::pmr::polymorphic_allocator<int>> t(&pool);
+        for (size_t i = 0; i < STRING_KEYS.size(); i++) t.insert({STRING_KEYS[i], (int)i});
+        for (auto& k : STRING_KEYS) found += t.contains(k);
+        std::cout << "Trie uses monotonic resource: " << (t.get_allocator().resource() == &pool ? "YES" : "NO") << "\n";
+    }
+    std::cout << "Found " << found << "/" << STRING_KEYS.size() << " keys\n\n";
+}
+
+void test_sync_policies() {
+    std::cout << "## Sync Policy Test\n\n";
+    
+    gteitelbaum::tktrie<std::string, int> concurrent;
+    gteitelbaum::tktrie<std::string, int, std::allocator<int>, gteitelbaum::sync_read_mostly> read_mostly;
+    gteitelbaum::tktrie<std::string, int, std::allocator<int>, gteitelbaum::sync_single_threaded> single;
+    for (size_t i = 0; i < STRING_KEYS.size(); i++) {
+        concurrent.insert({STRING_KEYS[i], (int)i});
+        read_mostly.insert({STRING_KEYS[i], (int)i});
+        single.insert({STRING_KEYS[i], (int)i});
+    }
+    for (size_t i = 0; i < STRING_KEYS.size(); i += 3) {
+        concurrent.erase(STRING_KEYS[i]);
+        read_mostly.erase(STRING_KEYS[i]);
+        single.erase(STRING_KEYS[i]);
+    }
+    
+    auto same = [&](const auto& t) {
+        return t.size() == concurrent.size() && std::equal(t.begin(), t.end(), concurrent.begin(), concurrent.end());
+    };
+    std::cout << "read_mostly matches concurrent: " << (same(read_mostly) ? "YES" : "NO") << "\n";
+    std::cout << "single_threaded matches concurrent: " << (same(single) ? "YES" : "NO") << "\n\n";
+}
+
+template <typename Trie>
+void print_stats(const char* label, const Trie& t) {
+    auto st = t.stats();
+    printf("%s: %zu keys, %zu nodes (N4 %zu, N16 %zu, N48 %zu, N256 %zu)\n", label, st.keys, st.nodes,
+           st.nodes_by_kind[0], st.nodes_by_kind[1], st.nodes_by_kind[2], st.nodes_by_kind[3]);
+    printf("  skip bytes %zu, unused slots %zu, node bytes %zu, value bytes %zu\n",
+           st.skip_bytes, st.slot_slack, st.node_bytes, st.value_bytes);
+    printf("  reserved %zu bytes, %.1f bytes/key\n", st.reserved_bytes, st.bytes_per_key());
+    std::cout << "  key depth:";
+    for (size_t d = 0; d < st.key_depth.size(); d++) if (st.key_depth[d]) std::cout << " " << d << ":" << st.key_depth[d];
+    std::cout << "\n";
+}
+
+void test_stats() {
+    std::cout << "## Stats Test\n\n";
+    
+    gteitelbaum::tktrie<std::string, int> strings;
+    for (size_t i = 0; i < STRING_KEYS.size(); i++) strings.insert({STRING_KEYS[i], (int)i});
+    print_stats("strings", strings);
+    
+    // int values sit inline in their nodes; strings each take one value block
+    gteitelbaum::tktrie<std::string, std::string> boxed;
+    for (size_t i = 0; i < STRING_KEYS.size(); i++) boxed.insert({STRING_KEYS[i], STRING_KEYS[i]});
+    print_stats("strings, string values", boxed);
+    
+    gteitelbaum::tktrie<uint64_t, int> ints;
+    for (size_t i = 0; i < UINT64_KEYS.size(); i++) ints.insert({UINT64_KEYS[i], (int)i});
+    print_stats("uint64", ints);
+    for (size_t i = 0; i < UINT64_KEYS.size(); i += 2) ints.erase(UINT64_KEYS[i]);
+    print_stats("uint64, half erased", ints);
+    // Erase prunes emptied nodes and fuses single children back, so every
+    // node but the root still holds a value or branches
+    auto half = ints.stats();
+    std::cout << "  at most 2 nodes per key: " << (half.nodes <= 2 * half.keys + 1 ? "YES" : "NO") << "\n";
+    for (size_t i = 1; i < UINT64_KEYS.size(); i += 2) ints.erase(UINT64_KEYS[i]);
+    auto none = ints.stats();
+    std::cout << "  all erased leaves only the root: " << (none.keys == 0 && none.nodes == 1 ? "YES" : "NO") << "\n";
+    
+    // A small trie draws small slabs instead of a full batch per size class
+    gteitelbaum::tktrie<uint64_t, int> small;
+    for (uint64_t k = 0; k < 10; k++) small.insert({k * 7919, (int)k});
+    size_t reserved = small.stats().reserved_bytes;
+    std::cout << "10-key trie reserves " << reserved << " bytes: " << (reserved <= 16384 ? "YES" : "NO") << "\n\n";
+}
+
+// A writer keeps "a" or a deep extension of it present at every instant, with
+// a branch at each level between them; readers' longest_prefix_match must
+// never come back empty while the two trade places
+void test_prefix_match_under_writes() {
+    std::cout << "## Longest Prefix Match Under Writes\n\n";
+    
+    gteitelbaum::tktrie<std::string, int> t;
+    std::string deep = "a" + std::string(250, 'b'), query = deep + "c";
+    t.insert({"a", 0});
+    for (int i = 1; i < 250; i++) t.insert({"a" + std::string(i, 'b') + "x", i});
+    
+    std::atomic<bool> stop{false};
+    std::atomic<long> empty{0}, reads{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; r++) {
+        readers.emplace_back([&] {
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (!t.longest_prefix_match(query).valid()) empty++;
+                reads++;
+            }
+        });
+    }
+    for (int i = 0; i < 20000; i++) {
+        t.insert({deep, i});
+        t.erase("a");
+        t.insert({"a", i});
+        t.erase(deep);
+    }
+    stop = true;
+    for (auto& th : readers) th.join();
+    
+    auto st = t.stats();
+    std::cout << "never empty: " << (empty == 0 ? "YES" : "NO") << " (" << reads << " reads, "
+              << st.read_restarts << " restarts)\n\n";
+}
+
+// Counters bumped through update() from several threads while another thread
+// keeps inserting and erasing neighbouring keys, so the counters' nodes are
+// copied and replaced underneath the CASes
+void test_update() {
+    std::cout << "## Update Test\n\n";
+    
+    gteitelbaum::tktrie<uint64_t, int> t;
+    const uint64_t counters = 64;
+    const int per_thread = 50000;
+    for (uint64_t k = 0; k < counters; k++) t.insert({k << 16, 0});
+    
+    std::atomic<bool> stop{false};
+    std::thread churn([&] {
+        std::mt19937_64 rng(7);
+        while (!stop.load(std::memory_order_relaxed)) {
+            uint64_t k = ((rng() % counters) << 16) | (rng() % 300 + 1);
+            if (rng() % 2) t.insert({k, 0});
+            else t.erase(k);
+        }
+    });
+    std::vector<std::thread> updaters;
+    for (int u = 0; u < 3; u++) {
+        updaters.emplace_back([&, u] {
+            std::mt19937_64 rng(u);
+            for (int i = 0; i < per_thread; i++) t.update((rng() % counters) << 16, [](int v) { return v + 1; });
+        });
+    }
+    for (auto& th : updaters) th.join();
+    stop = true;
+    churn.join();
+    
+    long sum = 0;
+    for (uint64_t k = 0; k < counters; k++) sum += t.find(k << 16).value();
+    std::cout << "no lost updates: " << (sum == 3L * per_thread ? "YES" : "NO") << "\n";
+    auto res = t.insert_or_assign(0, 42);
+    std::cout << "insert_or_assign overwrites: " << (!res.second && t.find(0).value() == 42 ? "YES" : "NO") << "\n\n";
+}
+
+// Writers on disjoint keys that share prefixes, so their nodes are split,
+// grown and swapped into the same parents by CAS, with an eraser pruning a
+// neighbouring range
+void test_concurrent_insert() {
+    std::cout << "## Concurrent Insert Test\n\n";
+    
+    gteitelbaum::tktrie<std::string, int> t;
+    const int writers = 8, per_thread = 20000;
+    std::atomic<bool> stop{false};
+    std::thread eraser([&] {
+        std::mt19937 rng(3);
+        while (!stop.load(std::memory_order_relaxed)) {
+            std::string k = "k" + std::to_string(rng() % 5000) + "x";
+            if (rng() % 2) t.insert({k, 0});
+            else t.erase(k);
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int w = 0; w < writers; w++) {
+        threads.emplace_back([&, w] {
+            for (int i = 0; i < per_thread; i++) t.insert({"k" + std::to_string(i * writers + w), i});
+        });
+    }
+    for (auto& th : threads) th.join();
+    stop = true;
+    eraser.join();
+    
+    bool all = true;
+    for (int i = 0; i < writers * per_thread; i++) {
+        auto it = t.find("k" + std::to_string(i));
+        all &= it != t.end() && it.value() == i / writers;
+    }
+    std::cout << "all inserts kept: " << (all ? "YES" : "NO") << "\n";
+    std::vector<std::string> keys;
+    for (auto it = t.begin(); it != t.end(); ++it) keys.push_back(it.key());
+    std::cout << "iteration sorted: " << (std::is_sorted(keys.begin(), keys.end()) ? "YES" : "NO") << "\n\n";
+}
+
+// A value whose copy stops at a gate once it is armed, so a test can hold a
+// thread at the point where the trie copies the value: a writer inside a
+// node it has claimed, or find_many between two rounds of its probe
+struct Gated {
+    enum State { idle, armed, waiting, open };
+    static inline std::atomic<int> gates[4] = {};
+    int gate = 0;
+    explicit Gated(int g = 0) : gate(g) {}
+    Gated(Gated&&) = default;
+    Gated& operator=(const Gated&) = default;
+    Gated& operator=(Gated&&) = default;
+    Gated(const Gated& o) : gate(o.gate) {
+        int expected = armed;
+        if (gate && gates[gate].compare_exchange_strong(expected, waiting))
+            while (gates[gate] != open) std::this_thread::yield();
+    }
+    static void arm(int g) { gates[g] = armed; }
+    static void await(int g) { while (gates[g] != waiting) std::this_thread::yield(); }
+    static void release(int g) { gates[g] = open; }
+};
+
+// An insert swaps a node's replacement into its parent by CAS. If the
+// parent is copied and unlinked first, that CAS must not land in the dead
+// parent: a reader still inside it would find the key there while later
+// readers, going through the parent's copy, do not.
+void test_child_swap_into_replaced_parent() {
+    std::cout << "## Child Swap Into Replaced Parent Test\n\n";
+
+    gteitelbaum::tktrie<std::string, Gated> t;
+    for (const char* k : {"qa", "qb", "qc", "qd", "z"}) t.insert({k, Gated(std::string(k) == "z" ? 1 : 0)});
+
+    // find_many stops after its first round, its "qax" probe standing on the
+    // Node4 under "q", copying the value it found for "z"
+    Gated::arm(1);
+    std::vector<std::string> keys = {"z", "qax"};
+    std::vector<gteitelbaum::tktrie<std::string, Gated>::iterator> found(keys.size());
+    std::thread reader([&] { t.find_many(keys, found); });
+    Gated::await(1);
+
+    // "qax" claims "qa" for a copy with a child and stops before swapping it in
+    Gated::arm(2);
+    std::thread claimer([&] { t.insert({"qax", Gated(2)}); });
+    Gated::await(2);
+
+    // "qe" outgrows the Node4, which is copied to a Node16 and unlinked; "qf"
+    // then holds the Node16 locked, so the claimer cannot finish its swap
+    t.insert({"qe", Gated()});
+    Gated::arm(3);
+    std::thread holder([&] { t.insert({"qf", Gated(3)}); });
+    Gated::await(3);
+
+    Gated::release(2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    Gated::release(1);
+    reader.join();
+    bool seen_then_gone = found[1] != t.end() && !t.contains("qax");
+
+    Gated::release(3);
+    claimer.join();
+    holder.join();
+    std::cout << "key once found stays found: " << (seen_then_gone ? "NO" : "YES") << "\n";
+    std::cout << "insert kept: " << (t.contains("qax") && t.contains("qf") ? "YES" : "NO") << "\n\n";
+}
+
+// Rank of a set byte in a 48-child bitmap: PopCount's cached per-word counts
+// against popcounting every preceding word
+void bench_popcount_rank(int ms) {
+    std::cout << "## PopCount Rank\n\n";
+    
+    std::mt19937 rng(42);
+    gteitelbaum::PopCount pop;
+    uint64_t words[4] = {};
+    std::vector<unsigned char> present;
+    while (present.size() < 48) {
+        unsigned char c = (unsigned char)rng();
+        if (words[c >> 6] & (1ULL << (c & 63))) continue;
+        words[c >> 6] |= 1ULL << (c & 63);
+        pop.set(c);
+        present.push_back(c);
+    }
+    std::vector<unsigned char> queries(4096);
+    for (auto& q : queries) q = present[rng() % present.size()];
+    
+    auto run = [&](auto rank) {
+        uint64_t ops = 0, sum = 0;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+        while (std::chrono::steady_clock::now() < deadline) {
+            for (unsigned char q : queries) sum += rank(q);
+            ops += queries.size();
+        }
+        return std::pair{ops * 1000.0 / ms, sum / ops};
+    };
+    auto [cached, cached_avg] = run([&](unsigned char c) { int idx = 0; pop.find(c, &idx); return idx; });
+    auto [looped, looped_avg] = run([&](unsigned char c) {
+        int idx = std::popcount(words[c >> 6] & ((1ULL << (c & 63)) - 1));
+        for (int w = 0; w < (c >> 6); ++w) idx += std::popcount(words[w]);
+        return idx;
+    });
+    
+    std::cout << "| Method | ranks/s |\n";
+    std::cout << "|--------|---------|\n";
+    printf("| cached prefix counts | %.2fM |\n", cached / 1e6);
+    printf("| per-word loop | %.2fM |\n", looped / 1e6);
+    std::cout << "\nSame ranks: " << (cached_avg == looped_avg ? "YES" : "NO") << "\n\n";
 }
 
 template<typename Keys>
@@ -341,6 +768,20 @@ void run_benchmark(const std::string& name, const Keys& keys, int ms) {
                threads, tr/1e6, m/1e6, u/1e6, tr/m, tr/u);
     }
     
+    std::cout << "\n### FIND (batched, 1 thread)\n\n";
+    std::cout << "| Batch | contains | contains_many | speedup |\n";
+    std::cout << "|-------|----------|---------------|---------|\n";
+    
+    {
+        gteitelbaum::tktrie<K, int> trie;
+        for (size_t i = 0; i < keys.size(); i++) trie.insert({keys[i], (int)i});
+        double single = bench_find(trie, keys, 1, ms);
+        for (size_t batch : {32, 256}) {
+            double many = bench_find_batched(trie, keys, batch, ms);
+            printf("| %zu | %.2fM | %.2fM | %.2fx |\n", batch, single/1e6, many/1e6, many/single);
+        }
+    }
+    
     std::cout << "\n### INSERT\n\n";
     std::cout << "| Threads | tktrie | std::map | std::unordered_map | tktrie/map | tktrie/umap |\n";
     std::cout << "|---------|--------|----------|-------------------|------------|-------------|\n";
@@ -386,6 +827,18 @@ int main() {
     std::cout << "- Duration: " << MS << "ms per test\n\n";
     
     test_signed_ordering();
+    test_string_prefixes();
+    test_transparent_lookup();
+    test_first_mismatch();
+    test_bulk_load();
+    test_pmr_allocator();
+    test_sync_policies();
+    test_stats();
+    test_prefix_match_under_writes();
+    test_update();
+    test_concurrent_insert();
+    test_child_swap_into_replaced_parent();
+    bench_popcount_rank(MS);
     
     run_benchmark("String Keys (std::string)", STRING_KEYS, MS);
     run_benchmark("Integer Keys (int)", INT_KEYS, MS);
@@ -1,20 +1,36 @@
 #pragma once
 // Thread-safe trie with version-based optimistic locking
 // - Reads are always lock-free
-// - Writes only lock if there's a conflict on the same path
+// - Writes lock only the node they modify, restarting if a version changed
+//   since the optimistic traversal; a replaced node is swapped into its
+//   parent's slot by CAS (sync_concurrent) or with the parent locked too
 
 #include <atomic>
 #include <bit>
 #include <cstdint>
 #include <cstring>
+#include <iterator>
 #include <memory>
+#include <memory_resource>
 #include <mutex>
+#include <new>
+#include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
+#include <algorithm>
 #include <array>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace gteitelbaum {
 
 template <typename T>
@@ -30,60 +46,721 @@ constexpr T my_byteswap(T value) noexcept {
 #endif
 }
 
+// Pause between optimistic restarts; yield once spinning looks unproductive
+inline void backoff(unsigned attempt) {
+#if defined(__SSE2__)
+    if (attempt < 16) { _mm_pause(); return; }
+#endif
+    (void)attempt;
+    std::this_thread::yield();
+}
+
+inline void prefetch(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+}
+
+// Index of the first differing byte of a and b within one W-sized word, or sizeof(W)
+template <typename W> inline size_t word_mismatch(const char* a, const char* b) {
+    W x, y;
+    std::memcpy(&x, a, sizeof(W));
+    std::memcpy(&y, b, sizeof(W));
+    W d = x ^ y;
+    if (!d) return sizeof(W);
+    return static_cast<size_t>(std::endian::native == std::endian::little ? std::countr_zero(d) : std::countl_zero(d)) / 8;
+}
+
+// Index of the first differing byte of a and b within n bytes, or n. The
+// widest block that fits steps through the range and finishes with one block
+// overlapping the end, so only ranges under 4 bytes are compared bytewise.
+inline size_t first_mismatch(const char* a, const char* b, size_t n) {
+#if defined(__AVX2__)
+    if (n >= 32) {
+        for (size_t i = 0;; i = std::min(i + 32, n - 32)) {
+            __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                                           _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+            unsigned diff = ~static_cast<unsigned>(_mm256_movemask_epi8(eq));
+            if (diff) return i + std::countr_zero(diff);
+            if (i + 32 == n) return n;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    if (n >= 16) {
+        for (size_t i = 0;; i = std::min(i + 16, n - 16)) {
+            __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                                        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+            unsigned diff = ~static_cast<unsigned>(_mm_movemask_epi8(eq)) & 0xFFFFu;
+            if (diff) return i + std::countr_zero(diff);
+            if (i + 16 == n) return n;
+        }
+    }
+#endif
+    if (n >= 8) {
+        for (size_t i = 0;; i = std::min(i + 8, n - 8)) {
+            size_t d = word_mismatch<uint64_t>(a + i, b + i);
+            if (d < 8) return i + d;
+            if (i + 8 == n) return n;
+        }
+    }
+    if (n >= 4) {
+        size_t d = word_mismatch<uint32_t>(a, b);
+        if (d < 4) return d;
+        d = word_mismatch<uint32_t>(a + n - 4, b + n - 4);
+        return d < 4 ? n - 4 + d : n;
+    }
+    for (size_t i = 0; i < n; ++i) if (a[i] != b[i]) return i;
+    return n;
+}
+
+inline size_t common_prefix_len(std::string_view a, std::string_view b) {
+    return first_mismatch(a.data(), b.data(), std::min(a.size(), b.size()));
+}
+
+inline bool has_prefix(std::string_view s, std::string_view prefix) {
+    return s.size() >= prefix.size() && first_mismatch(s.data(), prefix.data(), prefix.size()) == prefix.size();
+}
+
+// Up to the first 8 bytes of s packed so that byte i lands in bits 8i..8i+7
+inline uint64_t pack_prefix(std::string_view s) {
+    uint64_t w = 0;
+    std::memcpy(&w, s.data(), std::min<size_t>(s.size(), 8));
+    if constexpr (std::endian::native == std::endian::big) w = my_byteswap(w);
+    return w;
+}
+
+// Encoded fixed-length key held by value, so encoding never touches the heap
+template <size_t N> struct KeyBytes {
+    std::array<char, N> bytes;
+    operator std::string_view() const { return {bytes.data(), N}; }
+};
+
 template <typename Key> struct tktrie_traits;
 
 template <> struct tktrie_traits<std::string> {
     static constexpr size_t fixed_len = 0;
     static std::string_view to_bytes(const std::string& k) { return k; }
+    static std::string from_bytes(std::string_view b) { return std::string(b); }
 };
 
 template <typename T> requires std::is_integral_v<T>
 struct tktrie_traits<T> {
     static constexpr size_t fixed_len = sizeof(T);
     using unsigned_type = std::make_unsigned_t<T>;
-    static std::string to_bytes(T k) {
-        char buf[sizeof(T)];
+    static KeyBytes<sizeof(T)> to_bytes(T k) {
+        KeyBytes<sizeof(T)> out;
         unsigned_type sortable;
         if constexpr (std::is_signed_v<T>) {
             sortable = static_cast<unsigned_type>(k) + (unsigned_type{1} << (sizeof(T) * 8 - 1));
         } else { sortable = k; }
         unsigned_type be = my_byteswap(sortable);
-        std::memcpy(buf, &be, sizeof(T));
-        return std::string(buf, sizeof(T));
+        std::memcpy(out.bytes.data(), &be, sizeof(T));
+        return out;
+    }
+    static T from_bytes(std::string_view b) {
+        unsigned_type be;
+        std::memcpy(&be, b.data(), sizeof(T));
+        unsigned_type sortable = my_byteswap(be);
+        if constexpr (std::is_signed_v<T>) {
+            return static_cast<T>(sortable - (unsigned_type{1} << (sizeof(T) * 8 - 1)));
+        } else { return sortable; }
     }
 };
 
+// 256-bit child set with rank. before[w] caches the number of bits set in
+// the words below w, so rank is one popcount plus a load on every hop.
 class PopCount {
     uint64_t bits[4]{};
+    uint8_t before[4]{};
 public:
+    int rank(unsigned char c) const {
+        return before[c >> 6] + std::popcount(bits[c >> 6] & ((1ULL << (c & 63)) - 1));
+    }
     bool find(unsigned char c, int* idx) const {
-        int word = c >> 6, bit = c & 63;
-        uint64_t mask = 1ULL << bit;
-        if (!(bits[word] & mask)) return false;
-        *idx = std::popcount(bits[word] & (mask - 1));
-        for (int w = 0; w < word; ++w) *idx += std::popcount(bits[w]);
+        if (!(bits[c >> 6] & (1ULL << (c & 63)))) return false;
+        *idx = rank(c);
         return true;
     }
     int set(unsigned char c) {
-        int word = c >> 6, bit = c & 63;
-        uint64_t mask = 1ULL << bit;
-        int idx = std::popcount(bits[word] & (mask - 1));
-        for (int w = 0; w < word; ++w) idx += std::popcount(bits[w]);
-        bits[word] |= mask;
-        return idx;
+        bits[c >> 6] |= 1ULL << (c & 63);
+        for (int w = (c >> 6) + 1; w < 4; ++w) ++before[w];
+        return rank(c);
+    }
+    int clear(unsigned char c) {
+        bits[c >> 6] &= ~(1ULL << (c & 63));
+        for (int w = (c >> 6) + 1; w < 4; ++w) --before[w];
+        return rank(c);
+    }
+    // Smallest set byte >= from (from may be 256), or -1
+    int next_set(unsigned from) const {
+        for (unsigned w = from >> 6; w < 4; ++w) {
+            uint64_t b = bits[w];
+            if (w == from >> 6) b &= ~0ULL << (from & 63);
+            if (b) return static_cast<int>(w * 64 + std::countr_zero(b));
+        }
+        return -1;
+    }
+    // Largest set byte <= from (from may be -1), or -1
+    int prev_set(int from) const {
+        for (int w = from >> 6; w >= 0; --w) {
+            uint64_t b = bits[w];
+            if (w == from >> 6 && (from & 63) != 63) b &= (2ULL << (from & 63)) - 1;
+            if (b) return w * 64 + 63 - std::countl_zero(b);
+        }
+        return -1;
+    }
+    template <typename F> void for_each(F&& f) const {
+        for (int w = 0; w < 4; ++w)
+            for (uint64_t b = bits[w]; b; b &= b - 1) f(static_cast<unsigned char>(w * 64 + std::countr_zero(b)));
+    }
+};
+
+// Epoch-based reclamation. Readers pin the current epoch for the duration of
+// an operation; writers retire unlinked memory tagged with the epoch it was
+// unlinked in and free it once every pinned reader has moved two epochs on.
+class EpochDomain {
+public:
+    static constexpr uint64_t idle = ~uint64_t{0};
+    
+    struct alignas(64) Record {
+        std::atomic<uint64_t> epoch{idle};
+        std::atomic<bool> in_use{false};
+        Record* next{nullptr};
+        unsigned depth{0};   // guard nesting, touched only by the owning thread
+        unsigned index{0};   // creation order, so concurrent threads hold distinct indexes
+    };
+    
+    static EpochDomain& instance() { static EpochDomain domain; return domain; }
+    
+    // Records live for the life of the process and are recycled across threads
+    static Record* local() {
+        thread_local struct Holder {
+            Record* rec = instance().acquire();
+            ~Holder() { instance().release(rec); }
+        } holder;
+        return holder.rec;
+    }
+    
+    uint64_t current() const { return global_.load(std::memory_order_seq_cst); }
+    
+    // Advance the global epoch if every pinned record has seen it
+    uint64_t try_advance() {
+        uint64_t g = current();
+        for (Record* r = head_.load(std::memory_order_acquire); r; r = r->next) {
+            uint64_t e = r->epoch.load(std::memory_order_seq_cst);
+            if (e != idle && e != g) return g;
+        }
+        global_.compare_exchange_strong(g, g + 1, std::memory_order_seq_cst);
+        return current();
+    }
+
+private:
+    std::atomic<uint64_t> global_{1};
+    std::atomic<Record*> head_{nullptr};
+    std::atomic<unsigned> records_{0};
+    
+    Record* acquire() {
+        for (Record* r = head_.load(std::memory_order_acquire); r; r = r->next) {
+            bool expected = false;
+            if (r->in_use.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) return r;
+        }
+        Record* r = new Record();
+        r->index = records_.fetch_add(1, std::memory_order_relaxed);
+        r->in_use.store(true, std::memory_order_relaxed);
+        r->next = head_.load(std::memory_order_relaxed);
+        while (!head_.compare_exchange_weak(r->next, r, std::memory_order_acq_rel)) {}
+        return r;
+    }
+    void release(Record* r) {
+        r->epoch.store(idle, std::memory_order_release);
+        r->in_use.store(false, std::memory_order_release);
+    }
+};
+
+class EpochGuard {
+    EpochDomain::Record* rec_;
+public:
+    EpochGuard() : rec_(EpochDomain::local()) {
+        if (rec_->depth++ == 0) {
+            rec_->epoch.store(EpochDomain::instance().current(), std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+    ~EpochGuard() { if (--rec_->depth == 0) rec_->epoch.store(EpochDomain::idle, std::memory_order_release); }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// Per-owner list of unlinked memory waiting for readers to drain. Entries
+// go to a shard picked by the retiring thread's epoch record, so writers on
+// different threads rarely share a lock, and a shard that has grown enough
+// is swapped out and reclaimed outside its lock.
+class RetireList {
+    struct Entry { void* ptr; void (*free_fn)(void*, void*); void* ctx; uint64_t epoch; };
+    static constexpr size_t reclaim_threshold = 64, shard_count = 16;
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::vector<Entry> entries;
+        size_t next_reclaim{reclaim_threshold};
+    };
+    Shard shards_[shard_count];
+public:
+    RetireList() = default;
+    RetireList(const RetireList&) = delete;
+    RetireList& operator=(const RetireList&) = delete;
+    ~RetireList() {
+        for (auto& s : shards_) for (auto& e : s.entries) e.free_fn(e.ptr, e.ctx);
+    }
+    
+    void retire(void* ptr, void (*free_fn)(void*, void*), void* ctx = nullptr) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t epoch = EpochDomain::instance().current();
+        Shard& s = shards_[EpochDomain::local()->index % shard_count];
+        std::vector<Entry> batch;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.entries.push_back({ptr, free_fn, ctx, epoch});
+            if (s.entries.size() < s.next_reclaim) return;
+            batch.swap(s.entries);
+        }
+        reclaim(s, batch);
+    }
+
+private:
+    // Amortized: runs once a shard has doubled since the last pass left it
+    static void reclaim(Shard& s, std::vector<Entry>& batch) {
+        uint64_t g = EpochDomain::instance().try_advance();
+        size_t kept = 0;
+        for (auto& e : batch) {
+            if (e.epoch + 2 <= g) e.free_fn(e.ptr, e.ctx);
+            else batch[kept++] = e;
+        }
+        batch.resize(kept);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.entries.empty()) s.entries.swap(batch);   // keeps the grown buffer
+        else s.entries.insert(s.entries.end(), batch.begin(), batch.end());
+        s.next_reclaim = std::max(reclaim_threshold, s.entries.size() * 2);
+    }
+};
+
+// Fixed-size block pool. Blocks are carved from slabs that start at 4 KiB
+// and double up to 64 KiB, and that only go back upstream when the pool
+// dies, so a long-lived trie recycles its own memory instead of fragmenting
+// the general heap while a small one stays small. Each thread keeps a stash
+// of free blocks per pool, about a sixteenth of a full slab's worth; the
+// pool lock is only taken to move a batch between a stash and the shared
+// free list.
+class SlabPool {
+    struct FreeBlock { FreeBlock* next; };
+    struct Stash { uint64_t pool_id{0}; FreeBlock* head{nullptr}; unsigned count{0}; };
+    static constexpr unsigned stash_sets = 16, stash_ways = 4;
+    struct ThreadStashes {
+        Stash slots[stash_sets * stash_ways];
+        uint64_t deaths_seen{0};
+        ~ThreadStashes() { for (auto& s : slots) flush(s); }
+    };
+    // Live pools by id, so a stash flushed at thread exit finds its pool or learns it is gone
+    struct Registry {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, SlabPool*> live;
+        uint64_t next_id{1};
+        std::atomic<uint64_t> deaths{0};
+    };
+    struct Slab { void* base; size_t bytes; };
+    static constexpr size_t first_slab_bytes = 4 * 1024, slab_bytes = 64 * 1024;
+    static constexpr unsigned max_batch = 32;
+
+    std::pmr::memory_resource* upstream_;
+    const size_t block_size_;
+    const unsigned batch_;
+    const uint64_t id_;   // never reused, so a stale stash can never match a newer pool
+    mutable std::mutex mutex_;
+    FreeBlock* free_{nullptr};
+    char* bump_{nullptr};
+    char* bump_end_{nullptr};
+    size_t next_slab_;
+    size_t reserved_{0};
+    std::pmr::vector<Slab> slabs_;
+
+public:
+    SlabPool(std::pmr::memory_resource* upstream, size_t block_size)
+        : upstream_(upstream), block_size_(block_size),
+          batch_(static_cast<unsigned>(std::clamp<size_t>(slab_bytes / block_size / 4, 1, max_batch))),
+          id_(enroll(this)), next_slab_(std::max(first_slab_bytes, block_size)), slabs_(upstream) {}
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+    ~SlabPool() {
+        {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            registry().live.erase(id_);
+            registry().deaths.fetch_add(1, std::memory_order_relaxed);
+        }
+        for (const Slab& slab : slabs_) upstream_->deallocate(slab.base, slab.bytes, 16);
+    }
+
+    void* allocate() {
+        Stash* s = stash();
+        if (!s) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return next_block(true);
+        }
+        if (!s->head) refill(*s);
+        FreeBlock* b = s->head;
+        s->head = b->next;
+        --s->count;
+        return b;
+    }
+
+    // Bytes taken from upstream so far
+    size_t reserved() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return reserved_;
+    }
+
+    void deallocate(void* p) {
+        auto* b = static_cast<FreeBlock*>(p);
+        Stash* s = stash();
+        if (!s) {
+            b->next = nullptr;
+            give_back(b, 1);
+            return;
+        }
+        b->next = s->head;
+        s->head = b;
+        if (++s->count < 2 * batch_) return;
+        // Keep the most recently freed batch, hand the rest back
+        FreeBlock* keep = s->head;
+        for (unsigned i = 1; i < batch_; ++i) keep = keep->next;
+        FreeBlock* rest = keep->next;
+        keep->next = nullptr;
+        give_back(rest, s->count - batch_);
+        s->count = batch_;
+    }
+
+private:
+    static Registry& registry() { static Registry r; return r; }
+
+    static uint64_t enroll(SlabPool* pool) {
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        uint64_t id = registry().next_id++;
+        registry().live.emplace(id, pool);
+        return id;
+    }
+
+    // This thread's stash for the pool, from a small set-associative table.
+    // A pool claims an empty way of its set; when every way holds blocks the
+    // pool goes to its shared list instead of evicting, after first dropping
+    // the stashes of pools that have died since this thread last looked.
+    Stash* stash() {
+        thread_local ThreadStashes stashes;
+        Stash* set = &stashes.slots[(id_ % stash_sets) * stash_ways];
+        for (unsigned w = 0; w < stash_ways; ++w)
+            if (set[w].pool_id == id_) return &set[w];
+        for (int pass = 0; pass < 2; ++pass) {
+            for (unsigned w = 0; w < stash_ways; ++w) {
+                if (set[w].count == 0) {
+                    set[w] = Stash{id_, nullptr, 0};
+                    return &set[w];
+                }
+            }
+            uint64_t deaths = registry().deaths.load(std::memory_order_relaxed);
+            if (pass || deaths == stashes.deaths_seen) break;
+            stashes.deaths_seen = deaths;
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            for (unsigned w = 0; w < stash_ways; ++w)
+                if (!registry().live.count(set[w].pool_id)) set[w] = Stash{};   // its slabs are gone
+        }
+        return nullptr;
+    }
+
+    static void flush(Stash& s) {
+        if (s.head) {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            auto it = registry().live.find(s.pool_id);
+            if (it != registry().live.end()) it->second->give_back(s.head, s.count);
+        }
+        s = Stash{};
+    }
+
+    void give_back(FreeBlock* head, unsigned n) {
+        FreeBlock* tail = head;
+        for (unsigned i = 1; i < n; ++i) tail = tail->next;
+        std::lock_guard<std::mutex> lock(mutex_);
+        tail->next = free_;
+        free_ = head;
+    }
+
+    // Up to one batch, without opening a new slab once the stash has a block
+    void refill(Stash& s) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (s.count < batch_) {
+            FreeBlock* b = next_block(s.count == 0);
+            if (!b) break;
+            b->next = s.head;
+            s.head = b;
+            ++s.count;
+        }
+    }
+
+    // Caller holds mutex_
+    FreeBlock* next_block(bool may_grow) {
+        if (FreeBlock* b = free_) {
+            free_ = b->next;
+            return b;
+        }
+        if (bump_ == bump_end_) {
+            if (!may_grow) return nullptr;
+            bump_ = static_cast<char*>(upstream_->allocate(next_slab_, 16));
+            bump_end_ = bump_ + next_slab_ / block_size_ * block_size_;
+            slabs_.push_back({bump_, next_slab_});
+            reserved_ += next_slab_;
+            next_slab_ = std::min(next_slab_ * 2, slab_bytes);
+        }
+        auto* b = reinterpret_cast<FreeBlock*>(bump_);
+        bump_ += block_size_;
+        return b;
+    }
+};
+
+// Per-trie allocator behind nodes, skip strings and value blocks: one
+// SlabPool per 16-byte size class up to 4 KiB, created on first use. The
+// pools themselves and their slab lists come from upstream too. Larger
+// requests go straight upstream but stay linked here, so dropping the arena
+// releases everything without visiting individual blocks.
+class SlabArena {
+    static constexpr size_t granule = 16, max_small = 4096;
+    struct alignas(16) LargeBlock { LargeBlock* prev; LargeBlock* next; size_t bytes; };
+
+    std::pmr::memory_resource* upstream_;
+    std::atomic<SlabPool*> pools_[max_small / granule]{};
+    mutable std::mutex large_mutex_;
+    LargeBlock large_{&large_, &large_, 0};
+    size_t large_bytes_{0};
+
+public:
+    explicit SlabArena(std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+        : upstream_(upstream) {}
+    SlabArena(const SlabArena&) = delete;
+    SlabArena& operator=(const SlabArena&) = delete;
+    ~SlabArena() {
+        for (auto& p : pools_) {
+            if (SlabPool* pool = p.load(std::memory_order_relaxed)) drop_pool(pool);
+        }
+        for (LargeBlock* b = large_.next; b != &large_;) {
+            LargeBlock* next = b->next;
+            upstream_->deallocate(b, b->bytes, 16);
+            b = next;
+        }
+    }
+
+    void* allocate(size_t n) {
+        if (n <= max_small) return pool(n).allocate();
+        size_t bytes = sizeof(LargeBlock) + n;
+        auto* b = static_cast<LargeBlock*>(upstream_->allocate(bytes, 16));
+        b->bytes = bytes;
+        std::lock_guard<std::mutex> lock(large_mutex_);
+        large_bytes_ += bytes;
+        b->prev = &large_;
+        b->next = large_.next;
+        large_.next->prev = b;
+        large_.next = b;
+        return b + 1;
+    }
+
+    void deallocate(void* p, size_t n) {
+        if (n <= max_small) { pool(n).deallocate(p); return; }
+        LargeBlock* b = static_cast<LargeBlock*>(p) - 1;
+        {
+            std::lock_guard<std::mutex> lock(large_mutex_);
+            large_bytes_ -= b->bytes;
+            b->prev->next = b->next;
+            b->next->prev = b->prev;
+        }
+        upstream_->deallocate(b, b->bytes, 16);
+    }
+
+    // Footprint of an n-byte request, including size-class rounding
+    static size_t block_bytes(size_t n) {
+        return n <= max_small ? (n ? (n + granule - 1) / granule * granule : granule) : sizeof(LargeBlock) + n;
+    }
+
+    // Bytes currently held from upstream: every slab plus live large blocks
+    size_t reserved() const {
+        size_t total = 0;
+        for (auto& p : pools_) {
+            if (SlabPool* pool = p.load(std::memory_order_acquire)) total += pool->reserved();
+        }
+        std::lock_guard<std::mutex> lock(large_mutex_);
+        return total + large_bytes_;
+    }
+
+    template <typename U, typename... Args> U* create(Args&&... args) {
+        return new (allocate(sizeof(U))) U(std::forward<Args>(args)...);
+    }
+    template <typename U> void destroy(U* p) {
+        p->~U();
+        deallocate(p, sizeof(U));
+    }
+
+private:
+    SlabPool& pool(size_t n) {
+        size_t cls = n ? (n - 1) / granule : 0;
+        SlabPool* p = pools_[cls].load(std::memory_order_acquire);
+        if (!p) {
+            auto* fresh = new (upstream_->allocate(sizeof(SlabPool), alignof(SlabPool))) SlabPool(upstream_, (cls + 1) * granule);
+            if (pools_[cls].compare_exchange_strong(p, fresh, std::memory_order_acq_rel)) p = fresh;
+            else drop_pool(fresh);
+        }
+        return *p;
+    }
+    void drop_pool(SlabPool* p) {
+        p->~SlabPool();
+        upstream_->deallocate(p, sizeof(SlabPool), alignof(SlabPool));
+    }
+};
+
+// Adapts a std::allocator-compatible allocator into the upstream the arena
+// draws slabs, pools and large blocks from. Memory is requested in 16-byte
+// granules so blocks keep the arena's alignment, and calls are serialized
+// because allocators such as monotonic buffers are not thread-safe. The
+// trie's bookkeeping outside the arena (its retire list, and the spill of
+// unusually deep traversal paths) still uses the global heap.
+template <typename Alloc>
+class AllocatorResource final : public std::pmr::memory_resource {
+    struct alignas(16) Granule { std::byte bytes[16]; };
+    using granule_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Granule>;
+    using traits = std::allocator_traits<granule_alloc>;
+    granule_alloc alloc_;
+    std::mutex mutex_;
+public:
+    explicit AllocatorResource(const Alloc& a) : alloc_(a) {}
+    Alloc get() const { return Alloc(alloc_); }
+private:
+    static size_t granules(size_t bytes) { return (bytes + sizeof(Granule) - 1) / sizeof(Granule); }
+    void* do_allocate(size_t bytes, size_t) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::to_address(traits::allocate(alloc_, granules(bytes)));
+    }
+    void do_deallocate(void* p, size_t bytes, size_t) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        traits::deallocate(alloc_, static_cast<Granule*>(p), granules(bytes));
+    }
+    bool do_is_equal(const std::pmr::memory_resource& o) const noexcept override { return this == &o; }
+};
+
+template <typename U> struct ArenaAllocator {
+    using value_type = U;
+    SlabArena* arena;
+    explicit ArenaAllocator(SlabArena* a) noexcept : arena(a) {}
+    template <typename V> ArenaAllocator(const ArenaAllocator<V>& o) noexcept : arena(o.arena) {}
+    U* allocate(size_t n) { return static_cast<U*>(arena->allocate(n * sizeof(U))); }
+    void deallocate(U* p, size_t n) noexcept { arena->deallocate(p, n * sizeof(U)); }
+    template <typename V> bool operator==(const ArenaAllocator<V>& o) const noexcept { return arena == o.arena; }
+};
+
+using SkipString = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+
+// Small-buffer stack for traversal paths. The inline capacity covers every
+// path of a fixed-length key; only unusually deep string paths spill.
+template <typename E, size_t N> class PathStack {
+    E inline_[N];
+    std::vector<E> spill_;
+    size_t size_{0};
+public:
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    E& operator[](size_t i) { return i < N ? inline_[i] : spill_[i - N]; }
+    E& back() { return (*this)[size_ - 1]; }
+    void push_back(const E& e) {
+        if (size_ < N) inline_[size_] = e;
+        else spill_.push_back(e);
+        ++size_;
+    }
+    void pop_back() { resize(size_ - 1); }
+    void resize(size_t n) {   // shrink only
+        size_ = n;
+        spill_.resize(n > N ? n - N : 0);
     }
+    void clear() { size_ = 0; spill_.clear(); }
 };
 
-template <typename Key, typename T> class tktrie;
+// Shape and memory footprint of a trie, as returned by tktrie::stats()
+struct tktrie_stats {
+    size_t keys = 0;
+    size_t nodes = 0;
+    std::array<size_t, 4> nodes_by_kind{};   // Node4, Node16, Node48, Node256
+    std::vector<size_t> key_depth;           // keys by number of nodes walked to reach them
+    std::vector<size_t> fanout;              // nodes by child count
+    size_t skip_bytes = 0;                   // key bytes held in skips
+    size_t slot_slack = 0;                   // child slots allocated but unused
+    size_t node_bytes = 0;                   // node blocks plus out-of-line skip buffers
+    size_t value_bytes = 0;                  // value blocks
+    size_t reserved_bytes = 0;               // memory the trie's arena holds from its allocator
+    size_t read_restarts = 0;                // validated reads restarted by a concurrent write
+    size_t write_restarts = 0;               // inserts and erases restarted by a conflicting write
+    double bytes_per_key() const { return keys ? double(reserved_bytes) / double(keys) : 0.0; }
+};
+
+// Synchronization policies, tktrie's last template parameter
+// - sync_concurrent: lock-free readers; writers lock only the nodes they change
+//   and swap replacement nodes into the parent's slot by CAS
+// - sync_read_mostly: lock-free readers; writers share one trie-wide mutex
+//   and skip per-node locking
+// - sync_single_threaded: one thread at a time; no epochs, locks or atomic
+//   read-modify-writes, and replaced memory is freed immediately
+struct NoLock {
+    void lock() {}
+    void unlock() {}
+};
+
+struct sync_concurrent {
+    static constexpr bool shared_readers = true, node_locks = true;
+    using write_mutex = NoLock;
+};
+struct sync_read_mostly {
+    static constexpr bool shared_readers = true, node_locks = false;
+    using write_mutex = std::mutex;
+};
+struct sync_single_threaded {
+    static constexpr bool shared_readers = false, node_locks = false;
+    using write_mutex = NoLock;
+};
 
-template <typename Key, typename T>
+struct NoGuard {
+    NoGuard() {}
+};
+
+// Element count with the std::atomic interface, for tries no two threads touch at once
+template <typename N> struct PlainCounter {
+    N value{0};
+    N load(std::memory_order) const { return value; }
+    N fetch_add(N n, std::memory_order) { N old = value; value += n; return old; }
+    N fetch_sub(N n, std::memory_order) { N old = value; value -= n; return old; }
+};
+
+template <typename Key, typename T, typename Allocator = std::allocator<T>, typename Sync = sync_concurrent>
+class tktrie;
+
+// Snapshot of one (key, value) entry. Stepping re-seeks from the root for the
+// neighbouring key present at that moment, so iterators never pin nodes and
+// stay usable while other threads modify the trie.
+template <typename Key, typename T, typename Allocator = std::allocator<T>, typename Sync = sync_concurrent>
 class tktrie_iterator {
-    Key key_; T data_; bool valid_{false};
+    using trie_type = tktrie<Key, T, Allocator, Sync>;
+    const trie_type* trie_{nullptr};
+    Key key_{}; T data_{}; bool valid_{false};
 public:
+    using iterator_category = std::bidirectional_iterator_tag;
     using value_type = std::pair<Key, T>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = value_type;
     tktrie_iterator() = default;
-    tktrie_iterator(const Key& k, const T& d) : key_(k), data_(d), valid_(true) {}
-    static tktrie_iterator end_iterator() { return tktrie_iterator(); }
+    tktrie_iterator(const trie_type* t, const Key& k, const T& d) : trie_(t), key_(k), data_(d), valid_(true) {}
+    static tktrie_iterator end_iterator(const trie_type* t = nullptr) { tktrie_iterator it; it.trie_ = t; return it; }
     const Key& key() const { return key_; }
     T& value() { return data_; }
     value_type operator*() const { return {key_, data_}; }
@@ -92,340 +769,1706 @@ public:
         if (!valid_ && !o.valid_) return true;
         return valid_ && o.valid_ && key_ == o.key_;
     }
-    bool operator!=(const tktrie_iterator& o) const { return !(*this == o); }
-};
+    bool operator!=(const tktrie_iterator& o) const { return !(*this == o); }
+    
+    tktrie_iterator& operator++();   // next key in order; end() after the last
+    tktrie_iterator& operator--();   // previous key in order; --end() is the last
+    tktrie_iterator operator++(int) { auto old = *this; ++*this; return old; }
+    tktrie_iterator operator--(int) { auto old = *this; --*this; return old; }
+};
+
+// How a value is encoded in its node's slot word. Trivially copyable values
+// smaller than the word are stored inline beside a presence byte, so a hit is
+// read straight out of the node; anything else lives in a single arena block
+// the word points to. owned is what a writer builds before publishing and
+// what a removal hands over for retirement.
+template <typename T, bool Inline = std::is_trivially_copyable_v<T> && (sizeof(T) < sizeof(uint64_t))>
+struct ValueCodec {
+    static constexpr bool is_inline = false;
+    using ref = const T*;
+    using owned = T*;
+    static constexpr uint64_t frozen_bit = 1;   // arena blocks are 16-byte aligned
+    
+    static owned make(const T& v, SlabArena& a) { return a.template create<T>(v); }
+    static uint64_t encode(owned o) { return reinterpret_cast<uintptr_t>(o); }
+    static owned decode(uint64_t w) { return reinterpret_cast<T*>(static_cast<uintptr_t>(w & ~frozen_bit)); }
+    static ref view(uint64_t w) { return decode(w); }
+};
+
+template <typename T> struct ValueCodec<T, true> {
+    static constexpr bool is_inline = true;
+    using owned = uint64_t;   // 0 when empty; present values set the last byte
+    struct Packed {
+        std::array<unsigned char, sizeof(T)> value;
+        std::array<unsigned char, sizeof(uint64_t) - sizeof(T)> present;
+    };
+    struct ref {
+        uint64_t word = 0;
+        explicit operator bool() const { return word != 0; }
+        T operator*() const { return std::bit_cast<T>(std::bit_cast<Packed>(word).value); }
+    };
+    static constexpr uint64_t mark(unsigned char m) {
+        Packed p{};
+        p.present.back() = m;
+        return std::bit_cast<uint64_t>(p);
+    }
+    static constexpr uint64_t frozen_bit = mark(2);
+    
+    static owned make(const T& v, SlabArena&) {
+        return std::bit_cast<uint64_t>(Packed{std::bit_cast<decltype(Packed::value)>(v), {}}) | mark(1);
+    }
+    static uint64_t encode(owned o) { return o; }
+    static owned decode(uint64_t w) { return w & ~frozen_bit; }
+    static ref view(uint64_t w) { return {decode(w)}; }
+};
+
+// A node's value: one atomic word, so readers see a whole value or none.
+// Writers holding the node's lock fill and empty it; the lock-free value
+// operations swap it with a CAS. Before a node is copied into its
+// replacement the trie freezes its slot, so no CAS can land after the copy
+// has read it; a writer that finds frozen_bit goes looking for the
+// replacement instead. Single-threaded tries skip the freeze and the CAS.
+template <typename T> struct ValueSlot : ValueCodec<T> {
+    using codec = ValueCodec<T>;
+    using typename codec::ref;
+    using typename codec::owned;
+    
+    mutable std::atomic<uint64_t> word{0};   // mutable: copying a const node freezes it
+    
+    static bool present(uint64_t w) { return (w & ~codec::frozen_bit) != 0; }
+    static bool frozen(uint64_t w) { return (w & codec::frozen_bit) != 0; }
+    uint64_t load() const { return word.load(std::memory_order_acquire); }
+    ref get() const { return codec::view(load()); }
+    bool has() const { return present(load()); }
+    void adopt(owned o) { word.store(codec::encode(o), std::memory_order_release); }
+    void set(uint64_t w) { word.store(w, std::memory_order_release); }
+    owned take() { return codec::decode(word.exchange(0, std::memory_order_acq_rel)); }
+    bool cas(uint64_t& expected, uint64_t desired) {
+        return word.compare_exchange_strong(expected, desired, std::memory_order_acq_rel, std::memory_order_acquire);
+    }
+    // Lock-free value writers back off from a frozen slot
+    uint64_t freeze() const { return word.fetch_or(codec::frozen_bit, std::memory_order_acq_rel); }
+    void thaw() const { word.fetch_and(~codec::frozen_bit, std::memory_order_release); }
+    // The copy takes over the value; the source node is retired without it
+    void copy_from(const ValueSlot& o) {
+        word.store(o.load() & ~codec::frozen_bit, std::memory_order_relaxed);
+    }
+};
+
+// Nodes come in four size classes; children are stored inline so a hop costs
+// a single cache miss. Node4/Node16 keep sorted key bytes, Node48 indexes a
+// dense child array through a PopCount bitmap, Node256 is directly indexed.
+//
+// Once published a node's skip, kind and key layout never change. Structural
+// edits build a replacement with copy_as()/with_child() and swap it into the
+// parent's atomic child slot, so lock-free readers always see a whole node.
+// The only in-place edits are single atomic operations: on the value slot,
+// and on a child slot. Removing a child empties its slot but leaves its key
+// byte in a Node4/16/48, so the key can later be refilled in place; a Node256
+// fills and empties any slot that way. Copies drop the emptied slots.
+enum class NodeKind : uint8_t { N4, N16, N48, N256 };
+
+template <typename T> struct Node {
+    SkipString skip;   // its allocator doubles as the node's link to its arena
+    uint64_t skip_word{0};   // pack_prefix(skip), for single-compare skip checks on fixed keys
+    using value_slot = ValueSlot<T>;
+    using value_ref = typename value_slot::ref;
+    value_slot data;   // owned by the trie, never freed by destroy()
+    std::atomic<uint64_t> version{0};
+    std::atomic<Node*> replacement{nullptr};   // successor of a node claimed for replacement
+    NodeKind kind;
+    uint16_t slots{0};   // key bytes laid out in a Node4/16/48, emptied ones included
+    std::atomic<uint16_t> count{0};   // live children
+    
+    Node(NodeKind k, SlabArena& a) : skip(ArenaAllocator<char>(&a)), kind(k) {}
+    Node(const Node&) = delete;
+    Node& operator=(const Node&) = delete;
+    
+    SlabArena& arena() const { return *skip.get_allocator().arena; }
+    void set_skip(std::string_view s) {
+        skip.assign(s);
+        skip_word = pack_prefix(s);
+    }
+    bool has_data() const { return data.has(); }
+    value_ref get_data() const { return data.get(); }
+    void set_data(const T& val) { data.adopt(value_slot::make(val, arena())); }
+    
+    // Version word, a seqlock: bit 0 = write-locked (odd while a writer is
+    // inside), bit 1 = obsolete (unlinked), rest counts writes
+    static constexpr uint64_t locked_bit = 1, obsolete_bit = 2, version_step = 4;
+    static bool is_stable(uint64_t v) { return !(v & (locked_bit | obsolete_bit)); }
+    uint64_t get_version() const { return version.load(std::memory_order_acquire); }
+    // Upgrade a version read during traversal to a write lock; fails if anything changed
+    bool try_lock(uint64_t seen) {
+        return is_stable(seen) && version.compare_exchange_strong(seen, seen | locked_bit, std::memory_order_acquire);
+    }
+    void unlock() { version.fetch_add(version_step - locked_bit, std::memory_order_release); }
+    void unlock_obsolete() { version.fetch_add(obsolete_bit - locked_bit, std::memory_order_release); }
+    // A reader that locked n only to read it puts the version back untouched
+    void unlock_unchanged(uint64_t seen) { version.store(seen, std::memory_order_release); }
+    // Writers already serialized by a trie-wide mutex mark the same states
+    // with plain stores, for readers that validate
+    void mark_locked() { version.store(get_version() | locked_bit, std::memory_order_relaxed); }
+    void mark_unlocked(uint64_t step) { version.store(get_version() + step, std::memory_order_release); }
+    // count only changes under the node's lock; lock-free readers just load it
+    void add_count(int d) { count.store(static_cast<uint16_t>(count.load(std::memory_order_relaxed) + d), std::memory_order_relaxed); }
+    
+    // A node about to be copied into its replacement has its child slots
+    // frozen by tagging the pointers' low bit (nodes are 16-byte aligned).
+    // A CAS swapping one of its children then fails instead of landing in a
+    // node that is going away. Every read strips the tag.
+    static constexpr uintptr_t frozen_tag = 1;
+    static Node* load_child(const std::atomic<Node*>& slot) {
+        return reinterpret_cast<Node*>(reinterpret_cast<uintptr_t>(slot.load(std::memory_order_acquire)) & ~frozen_tag);
+    }
+    void freeze_children();   // claimed nodes only
+    
+    Node* get_child(unsigned char c) const;
+    std::atomic<Node*>* child_ref(unsigned char c);
+    void add_child(unsigned char c, Node* child);   // in place only where child_ref(c) has a slot
+    void remove_child(unsigned char c);              // empties c's slot in place
+    Node* copy_as(NodeKind k, std::string_view new_skip) const;
+    Node* with_child(unsigned char c, Node* child) const;   // copy, a size class up if full
+    Node* without_child(unsigned char c) const;             // copy in the smallest class that fits
+    Node* fused_with(unsigned char c, const Node* child) const;   // child copy taking our skip + c
+    template <typename F> void for_each_child(F&& f) const;   // ascending key order
+    Node* next_child(unsigned from, unsigned char* key) const;   // first child keyed >= from
+    Node* prev_child(int from, unsigned char* key) const;        // last child keyed <= from
+    static NodeKind size_class(unsigned children) {
+        return children <= 4 ? NodeKind::N4 : children <= 16 ? NodeKind::N16
+             : children <= 48 ? NodeKind::N48 : NodeKind::N256;
+    }
+    static Node* make(NodeKind k, SlabArena& a);
+    static void destroy(Node* n);
+};
+
+template <typename T, unsigned Cap> struct SortedNode : Node<T> {
+    static constexpr NodeKind node_kind = Cap == 4 ? NodeKind::N4 : NodeKind::N16;
+    unsigned char keys[Cap]{};
+    std::atomic<Node<T>*> children[Cap]{};
+    
+    explicit SortedNode(SlabArena& a) : Node<T>(node_kind, a) {}
+    
+    int find_pos(unsigned char c) const {
+#if defined(__SSE2__)
+        if constexpr (Cap == 16) {
+            __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(c)),
+                                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys)));
+            unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(cmp)) & ((1u << this->slots) - 1);
+            return bits ? std::countr_zero(bits) : -1;
+        }
+#endif
+        for (int i = 0; i < this->slots; ++i) if (keys[i] == c) return i;
+        return -1;
+    }
+    // First live child keyed >= from / last keyed <= from, or nullptr
+    Node<T>* next_live(unsigned from, unsigned char* key) const {
+        for (int i = 0; i < this->slots; ++i) {
+            if (keys[i] < from) continue;
+            if (Node<T>* child = Node<T>::load_child(children[i])) {
+                *key = keys[i];
+                return child;
+            }
+        }
+        return nullptr;
+    }
+    Node<T>* prev_live(int from, unsigned char* key) const {
+        for (int i = this->slots - 1; i >= 0; --i) {
+            if (keys[i] > from) continue;
+            if (Node<T>* child = Node<T>::load_child(children[i])) {
+                *key = keys[i];
+                return child;
+            }
+        }
+        return nullptr;
+    }
+    void insert(unsigned char c, Node<T>* child) {
+        int pos = this->slots;
+        while (pos > 0 && keys[pos - 1] > c) {
+            keys[pos] = keys[pos - 1];
+            children[pos].store(children[pos - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            --pos;
+        }
+        keys[pos] = c;
+        children[pos].store(child, std::memory_order_relaxed);
+        ++this->slots;
+        this->add_count(1);
+    }
+    void copy_from(const SortedNode& o) {
+        std::memcpy(keys, o.keys, sizeof(keys));
+        for (int i = 0; i < o.slots; ++i) children[i].store(Node<T>::load_child(o.children[i]), std::memory_order_relaxed);
+        this->slots = o.slots;
+        this->count.store(o.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+};
+
+template <typename T> using Node4 = SortedNode<T, 4>;
+template <typename T> using Node16 = SortedNode<T, 16>;
+
+template <typename T> struct Node48 : Node<T> {
+    PopCount pop{};
+    std::atomic<Node<T>*> children[48]{};
+    
+    explicit Node48(SlabArena& a) : Node<T>(NodeKind::N48, a) {}
+    
+    void insert(unsigned char c, Node<T>* child) {
+        int idx = pop.set(c);
+        for (int i = this->slots; i > idx; --i)
+            children[i].store(children[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        children[idx].store(child, std::memory_order_relaxed);
+        ++this->slots;
+        this->add_count(1);
+    }
+    // First live child keyed >= from / last keyed <= from, or nullptr
+    Node<T>* next_live(unsigned from, unsigned char* key) const {
+        for (int c = pop.next_set(from); c >= 0; c = pop.next_set(c + 1u)) {
+            if (Node<T>* child = Node<T>::load_child(children[pop.rank(static_cast<unsigned char>(c))])) {
+                *key = static_cast<unsigned char>(c);
+                return child;
+            }
+        }
+        return nullptr;
+    }
+    Node<T>* prev_live(int from, unsigned char* key) const {
+        for (int c = pop.prev_set(from); c >= 0; c = pop.prev_set(c - 1)) {
+            if (Node<T>* child = Node<T>::load_child(children[pop.rank(static_cast<unsigned char>(c))])) {
+                *key = static_cast<unsigned char>(c);
+                return child;
+            }
+        }
+        return nullptr;
+    }
+    void copy_from(const Node48& o) {
+        pop = o.pop;
+        for (int i = 0; i < o.slots; ++i) children[i].store(Node<T>::load_child(o.children[i]), std::memory_order_relaxed);
+        this->slots = o.slots;
+        this->count.store(o.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+};
+
+template <typename T> struct Node256 : Node<T> {
+    std::atomic<Node<T>*> children[256]{};
+    
+    explicit Node256(SlabArena& a) : Node<T>(NodeKind::N256, a) {}
+    
+    void copy_from(const Node256& o) {
+        for (int c = 0; c < 256; ++c) children[c].store(Node<T>::load_child(o.children[c]), std::memory_order_relaxed);
+        this->count.store(o.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+};
+
+template <typename T>
+Node<T>* Node<T>::get_child(unsigned char c) const {
+    switch (kind) {
+    case NodeKind::N4: {
+        auto* n = static_cast<const Node4<T>*>(this);
+        int pos = n->find_pos(c);
+        return pos < 0 ? nullptr : load_child(n->children[pos]);
+    }
+    case NodeKind::N16: {
+        auto* n = static_cast<const Node16<T>*>(this);
+        int pos = n->find_pos(c);
+        return pos < 0 ? nullptr : load_child(n->children[pos]);
+    }
+    case NodeKind::N48: {
+        auto* n = static_cast<const Node48<T>*>(this);
+        int idx;
+        return n->pop.find(c, &idx) ? load_child(n->children[idx]) : nullptr;
+    }
+    case NodeKind::N256:
+        return load_child(static_cast<const Node256<T>*>(this)->children[c]);
+    }
+    return nullptr;
+}
+
+template <typename T>
+std::atomic<Node<T>*>* Node<T>::child_ref(unsigned char c) {
+    switch (kind) {
+    case NodeKind::N4: {
+        auto* n = static_cast<Node4<T>*>(this);
+        int pos = n->find_pos(c);
+        return pos < 0 ? nullptr : &n->children[pos];
+    }
+    case NodeKind::N16: {
+        auto* n = static_cast<Node16<T>*>(this);
+        int pos = n->find_pos(c);
+        return pos < 0 ? nullptr : &n->children[pos];
+    }
+    case NodeKind::N48: {
+        auto* n = static_cast<Node48<T>*>(this);
+        int idx;
+        return n->pop.find(c, &idx) ? &n->children[idx] : nullptr;
+    }
+    case NodeKind::N256:
+        return &static_cast<Node256<T>*>(this)->children[c];
+    }
+    return nullptr;
+}
+
+template <typename T>
+void Node<T>::freeze_children() {
+    auto freeze = [](std::atomic<Node*>& slot) {
+        Node* p = slot.load(std::memory_order_relaxed);
+        while (p && !slot.compare_exchange_weak(p, reinterpret_cast<Node*>(reinterpret_cast<uintptr_t>(p) | frozen_tag),
+                                                std::memory_order_acq_rel, std::memory_order_relaxed)) {}
+    };
+    switch (kind) {
+    case NodeKind::N4: for (int i = 0; i < slots; ++i) freeze(static_cast<Node4<T>*>(this)->children[i]); break;
+    case NodeKind::N16: for (int i = 0; i < slots; ++i) freeze(static_cast<Node16<T>*>(this)->children[i]); break;
+    case NodeKind::N48: for (int i = 0; i < slots; ++i) freeze(static_cast<Node48<T>*>(this)->children[i]); break;
+    // Empty Node256 slots are only filled under the node's lock, which its claimer holds
+    case NodeKind::N256: for (auto& slot : static_cast<Node256<T>*>(this)->children) freeze(slot); break;
+    }
+}
+
+template <typename T>
+void Node<T>::add_child(unsigned char c, Node* child) {
+    if (std::atomic<Node*>* slot = child_ref(c)) {
+        slot->store(child, std::memory_order_release);
+        add_count(1);
+        return;
+    }
+    switch (kind) {
+    case NodeKind::N4: static_cast<Node4<T>*>(this)->insert(c, child); break;
+    case NodeKind::N16: static_cast<Node16<T>*>(this)->insert(c, child); break;
+    case NodeKind::N48: static_cast<Node48<T>*>(this)->insert(c, child); break;
+    case NodeKind::N256: break;
+    }
+}
+
+template <typename T>
+void Node<T>::remove_child(unsigned char c) {
+    child_ref(c)->store(nullptr, std::memory_order_release);
+    add_count(-1);
+}
+
+template <typename T>
+Node<T>* Node<T>::copy_as(NodeKind k, std::string_view new_skip) const {
+    Node* n = make(k, arena());
+    n->set_skip(new_skip);
+    n->data.copy_from(data);
+    if (k != kind || (k != NodeKind::N256 && slots != count)) {
+        for_each_child([n](unsigned char c, Node* child) { n->add_child(c, child); });
+        return n;
+    }
+    // Same-kind copies with no emptied slots take the child layout wholesale
+    switch (k) {
+    case NodeKind::N4: static_cast<Node4<T>*>(n)->copy_from(*static_cast<const Node4<T>*>(this)); break;
+    case NodeKind::N16: static_cast<Node16<T>*>(n)->copy_from(*static_cast<const Node16<T>*>(this)); break;
+    case NodeKind::N48: static_cast<Node48<T>*>(n)->copy_from(*static_cast<const Node48<T>*>(this)); break;
+    case NodeKind::N256: static_cast<Node256<T>*>(n)->copy_from(*static_cast<const Node256<T>*>(this)); break;
+    }
+    return n;
+}
+
+template <typename T>
+Node<T>* Node<T>::with_child(unsigned char c, Node* child) const {
+    Node* n = copy_as(size_class(count + 1u), skip);
+    n->add_child(c, child);
+    return n;
+}
+
+template <typename T>
+Node<T>* Node<T>::without_child(unsigned char c) const {
+    NodeKind k = size_class(count - 1u);
+    if (k == NodeKind::N256) {
+        Node* n = copy_as(k, skip);
+        n->remove_child(c);
+        return n;
+    }
+    Node* n = make(k, arena());
+    n->set_skip(skip);
+    n->data.copy_from(data);
+    for_each_child([n, c](unsigned char key, Node* child) { if (key != c) n->add_child(key, child); });
+    return n;
+}
+
+template <typename T>
+Node<T>* Node<T>::fused_with(unsigned char c, const Node* child) const {
+    Node* n = child->copy_as(child->kind, skip);
+    n->skip.push_back(static_cast<char>(c));
+    n->skip.append(child->skip);
+    n->skip_word = pack_prefix(n->skip);
+    return n;
+}
+
+template <typename T>
+template <typename F>
+void Node<T>::for_each_child(F&& f) const {
+    switch (kind) {
+    case NodeKind::N4: {
+        auto* n = static_cast<const Node4<T>*>(this);
+        for (int i = 0; i < slots; ++i) {
+            if (Node* child = load_child(n->children[i])) f(n->keys[i], child);
+        }
+        break;
+    }
+    case NodeKind::N16: {
+        auto* n = static_cast<const Node16<T>*>(this);
+        for (int i = 0; i < slots; ++i) {
+            if (Node* child = load_child(n->children[i])) f(n->keys[i], child);
+        }
+        break;
+    }
+    case NodeKind::N48: {
+        auto* n = static_cast<const Node48<T>*>(this);
+        int idx = 0;
+        n->pop.for_each([&](unsigned char c) {
+            if (Node* child = load_child(n->children[idx++])) f(c, child);
+        });
+        break;
+    }
+    case NodeKind::N256: {
+        auto* n = static_cast<const Node256<T>*>(this);
+        for (int c = 0; c < 256; ++c) {
+            if (Node* child = load_child(n->children[c])) f(static_cast<unsigned char>(c), child);
+        }
+        break;
+    }
+    }
+}
+
+template <typename T>
+Node<T>* Node<T>::next_child(unsigned from, unsigned char* key) const {
+    switch (kind) {
+    case NodeKind::N4: return static_cast<const Node4<T>*>(this)->next_live(from, key);
+    case NodeKind::N16: return static_cast<const Node16<T>*>(this)->next_live(from, key);
+    case NodeKind::N48: return static_cast<const Node48<T>*>(this)->next_live(from, key);
+    case NodeKind::N256: {
+        auto* n = static_cast<const Node256<T>*>(this);
+        for (unsigned c = from; c < 256; ++c) {
+            if (Node* child = load_child(n->children[c])) {
+                *key = static_cast<unsigned char>(c);
+                return child;
+            }
+        }
+        return nullptr;
+    }
+    }
+    return nullptr;
+}
+
+template <typename T>
+Node<T>* Node<T>::prev_child(int from, unsigned char* key) const {
+    switch (kind) {
+    case NodeKind::N4: return static_cast<const Node4<T>*>(this)->prev_live(from, key);
+    case NodeKind::N16: return static_cast<const Node16<T>*>(this)->prev_live(from, key);
+    case NodeKind::N48: return static_cast<const Node48<T>*>(this)->prev_live(from, key);
+    case NodeKind::N256: {
+        auto* n = static_cast<const Node256<T>*>(this);
+        for (int c = from; c >= 0; --c) {
+            if (Node* child = load_child(n->children[c])) {
+                *key = static_cast<unsigned char>(c);
+                return child;
+            }
+        }
+        return nullptr;
+    }
+    }
+    return nullptr;
+}
+
+template <typename T>
+Node<T>* Node<T>::make(NodeKind k, SlabArena& a) {
+    switch (k) {
+    case NodeKind::N4: return a.create<Node4<T>>(a);
+    case NodeKind::N16: return a.create<Node16<T>>(a);
+    case NodeKind::N48: return a.create<Node48<T>>(a);
+    case NodeKind::N256: return a.create<Node256<T>>(a);
+    }
+    return nullptr;
+}
 
-template <typename T> struct Node {
-    PopCount pop{};
-    std::vector<Node*> children{};
-    std::string skip{};
-    std::shared_ptr<T> data;
-    std::atomic<uint64_t> version{0};
-    
-    Node() = default;
-    Node(const Node&) = delete;
-    Node& operator=(const Node&) = delete;
-    
-    bool has_data() const { return data != nullptr; }
-    void set_data(const T& val) { data = std::make_shared<T>(val); }
-    void clear_data() { data.reset(); }
-    uint64_t get_version() const { return version.load(std::memory_order_acquire); }
-    void inc_version() { version.fetch_add(1, std::memory_order_release); }
-    
-    Node* get_child(unsigned char c) const { 
-        int idx; 
-        return pop.find(c, &idx) ? children[idx] : nullptr; 
+template <typename T>
+void Node<T>::destroy(Node* n) {
+    SlabArena& a = n->arena();
+    switch (n->kind) {
+    case NodeKind::N4: a.destroy(static_cast<Node4<T>*>(n)); break;
+    case NodeKind::N16: a.destroy(static_cast<Node16<T>*>(n)); break;
+    case NodeKind::N48: a.destroy(static_cast<Node48<T>*>(n)); break;
+    case NodeKind::N256: a.destroy(static_cast<Node256<T>*>(n)); break;
     }
-    bool get_child_idx(unsigned char c, int* idx) const { return pop.find(c, idx); }
-};
+}
 
-template <typename Key, typename T>
+template <typename Key, typename T, typename Allocator, typename Sync>
 class tktrie {
 public:
     using Traits = tktrie_traits<Key>;
     static constexpr size_t fixed_len = Traits::fixed_len;
     static constexpr bool is_fixed = (fixed_len > 0);
     using node_type = Node<T>;
+    using value_slot = typename node_type::value_slot;
+    using value_ref = typename node_type::value_ref;
+    using node4_type = Node4<T>;
+    using node256_type = Node256<T>;
     using size_type = std::size_t;
-    using iterator = tktrie_iterator<Key, T>;
+    using iterator = tktrie_iterator<Key, T, Allocator, Sync>;
+    using allocator_type = Allocator;
+    using sync_policy = Sync;
+    static_assert(alignof(T) <= 16, "values live in 16-byte aligned slab blocks");
 
 private:
-    node_type* root_;
-    std::atomic<size_type> elem_count_{0};
-    mutable std::mutex write_mutex_;
+    friend iterator;
+
+    AllocatorResource<Allocator> upstream_;   // the arena's only source of memory
+    SlabArena arena_;   // owns every node, skip buffer and value block
+    node_type* root_;   // always a Node256 with empty skip, so it is never replaced
+    using guard_type = std::conditional_t<Sync::shared_readers, EpochGuard, NoGuard>;
+    std::conditional_t<Sync::shared_readers, std::atomic<size_type>, PlainCounter<size_type>> elem_count_;
+    // Optimistic walks abandoned because a node changed underneath them
+    mutable std::conditional_t<Sync::shared_readers, std::atomic<size_t>, PlainCounter<size_t>> read_restarts_, write_restarts_;
+    RetireList retired_;   // replaced nodes and erased values readers may still be inside
+    [[no_unique_address]] mutable typename Sync::write_mutex write_mutex_;
     
     struct PathEntry { 
         node_type* node; 
         int child_idx;
+        uint32_t key_pos;   // key bytes consumed before node's skip
         uint64_t version;
     };
+    using Path = PathStack<PathEntry, is_fixed ? fixed_len + 1 : 32>;
 
-    void delete_tree(node_type* n) {
-        if (!n) return;
-        for (auto* c : n->children) delete_tree(c);
-        delete n;
+    // Only values can have destructors that matter; nodes and their skip
+    // buffers are released with the arena's slabs
+    void destroy_values(node_type* n) {
+        n->for_each_child([this](unsigned char, node_type* c) { destroy_values(c); });
+        if (auto d = n->get_data()) d->~T();
     }
     
-    // Check if all nodes on path still have same versions
-    bool path_valid(const std::vector<PathEntry>& path) const {
-        for (const auto& e : path) {
-            if (e.node->get_version() != e.version) return false;
-        }
+    void retire_node(node_type* n) {
+        if constexpr (!Sync::shared_readers) node_type::destroy(n);
+        else retired_.retire(n, [](void* p, void*) { node_type::destroy(static_cast<node_type*>(p)); });
+    }
+    // Inline values go with their node; boxed ones are freed like nodes
+    void retire_data(typename value_slot::owned d) {
+        if constexpr (value_slot::is_inline) return;
+        else if constexpr (!Sync::shared_readers) free_value(d);
+        else retired_.retire(d, [](void* p, void* a) { static_cast<SlabArena*>(a)->destroy(static_cast<T*>(p)); }, &arena_);
+    }
+    
+    // For values no reader has seen
+    void free_value(typename value_slot::owned d) {
+        if constexpr (!value_slot::is_inline) arena_.destroy(d);
+    }
+    
+    // Node write locks exist only under sync_concurrent. sync_read_mostly
+    // never runs two writers at once, so its locks always succeed but still
+    // move versions for validating readers; single-threaded versions stay put.
+    static bool try_lock(node_type* n, uint64_t seen) {
+        if constexpr (Sync::node_locks) return n->try_lock(seen);
+        else if constexpr (Sync::shared_readers) n->mark_locked();
         return true;
     }
-
+    static void unlock(node_type* n) {
+        if constexpr (Sync::node_locks) n->unlock();
+        else if constexpr (Sync::shared_readers) n->mark_unlocked(node_type::version_step - node_type::locked_bit);
+    }
+    static void unlock_obsolete(node_type* n) {
+        if constexpr (Sync::node_locks) n->unlock_obsolete();
+        else if constexpr (Sync::shared_readers) n->mark_unlocked(node_type::obsolete_bit - node_type::locked_bit);
+    }
+    
 public:
-    tktrie() : root_(new node_type()) {}
-    ~tktrie() { delete_tree(root_); }
+    tktrie() : tktrie(Allocator()) {}
+    explicit tktrie(const Allocator& alloc)
+        : upstream_(alloc), arena_(&upstream_), root_(node_type::make(NodeKind::N256, arena_)) {}
+    template <std::input_iterator It>
+    tktrie(It first, It last, const Allocator& alloc = Allocator()) : tktrie(alloc) { bulk_load(first, last); }
+    ~tktrie() {
+        if constexpr (!std::is_trivially_destructible_v<T>) destroy_values(root_);
+    }
+    allocator_type get_allocator() const { return upstream_.get(); }
     bool empty() const { return size() == 0; }
     size_type size() const { return elem_count_.load(std::memory_order_relaxed); }
+    
+    // Walks the whole trie. Under concurrent writes the counts may blend
+    // states from before and after a change, but the walk itself is safe.
+    tktrie_stats stats() const {
+        guard_type guard;
+        tktrie_stats st;
+        st.keys = size();
+        st.read_restarts = read_restarts_.load(std::memory_order_relaxed);
+        st.write_restarts = write_restarts_.load(std::memory_order_relaxed);
+        collect_stats(root_, 1, st);
+        st.reserved_bytes = arena_.reserved();
+        return st;
+    }
 
     bool contains(const Key& key) const {
-        if constexpr (is_fixed) return contains_impl(Traits::to_bytes(key));
-        else return contains_impl(Traits::to_bytes(key));
+        guard_type guard;
+        return static_cast<bool>(find_impl(Traits::to_bytes(key)));
     }
     
     iterator find(const Key& key) const {
-        if constexpr (is_fixed) return find_impl(key, Traits::to_bytes(key));
-        else return find_impl(key, Traits::to_bytes(key));
+        guard_type guard;
+        auto d = find_impl(Traits::to_bytes(key));
+        return d ? iterator(this, key, *d) : end();
+    }
+    
+    // Transparent lookups for string tries: std::string_view, const char* and
+    // anything else convertible to std::string_view go straight to the
+    // traversal without building a temporary Key (find builds one on a hit)
+    template <typename K>
+    static constexpr bool is_transparent = !is_fixed && !std::is_same_v<std::remove_cvref_t<K>, Key> &&
+                                           std::is_convertible_v<const K&, std::string_view>;
+    
+    template <typename K> requires is_transparent<K>
+    bool contains(const K& key) const {
+        guard_type guard;
+        return static_cast<bool>(find_impl(std::string_view(key)));
+    }
+    
+    template <typename K> requires is_transparent<K>
+    iterator find(const K& key) const {
+        guard_type guard;
+        std::string_view kv(key);
+        auto d = find_impl(kv);
+        return d ? iterator(this, Traits::from_bytes(kv), *d) : end();
+    }
+    
+    template <typename K> requires is_transparent<K>
+    bool erase(const K& key) {
+        guard_type guard;
+        std::lock_guard<typename Sync::write_mutex> lock(write_mutex_);
+        return erase_impl(std::string_view(key));
+    }
+    
+    // Batched lookups; out must have room for keys.size() results
+    void find_many(std::span<const Key> keys, std::span<iterator> out) const {
+        probe_many(keys, [&](size_t i, value_ref d) { out[i] = d ? iterator(this, keys[i], *d) : end(); });
+    }
+    void contains_many(std::span<const Key> keys, std::span<bool> out) const {
+        probe_many(keys, [&](size_t i, value_ref d) { out[i] = static_cast<bool>(d); });
+    }
+    
+    iterator begin() const {
+        guard_type guard;
+        return seek_up(std::string_view(), true);
+    }
+    iterator end() const { return iterator::end_iterator(this); }
+    
+    // First key not less than / greater than key
+    iterator lower_bound(const Key& key) const {
+        guard_type guard;
+        const auto& kv = Traits::to_bytes(key);
+        return seek_up(kv, true);
+    }
+    iterator upper_bound(const Key& key) const {
+        guard_type guard;
+        const auto& kv = Traits::to_bytes(key);
+        return seek_up(kv, false);
+    }
+    std::pair<iterator, iterator> equal_range(const Key& key) const {
+        iterator lo = lower_bound(key);
+        if (!lo.valid() || lo.key() != key) return {lo, lo};
+        return {lo, upper_bound(key)};
+    }
+    
+    // Calls fn(key, value) for each key in [from, to) in ascending order,
+    // streaming from a single descent to from. fn may return false to stop.
+    // Returns the number of entries passed to fn.
+    template <typename F>
+    size_type scan(const Key& from, const Key& to, F&& fn) const {
+        guard_type guard;
+        const auto& lo = Traits::to_bytes(from);
+        const auto& hi_bytes = Traits::to_bytes(to);
+        std::string_view hi(hi_bytes);
+        size_type visited = 0;
+        auto emit = [&](std::string_view bytes, const T& v) {
+            if (bytes >= hi) return false;
+            ++visited;
+            return visit(fn, Traits::from_bytes(bytes), v);
+        };
+        std::string prefix;
+        walk_from(root_, lo, true, prefix, emit);
+        return visited;
     }
     
-    iterator end() const { return iterator::end_iterator(); }
+    // Calls fn(key, value) in ascending order for each key starting with
+    // prefix; fn may return false to stop. Returns the number of entries visited.
+    template <typename F>
+    size_type for_each_prefix(std::string_view prefix, F&& fn) const requires (!is_fixed) {
+        guard_type guard;
+        std::string path;
+        const node_type* sub = find_subtree(prefix, path);
+        if (!sub) return 0;
+        size_type visited = 0;
+        auto emit = [&](std::string_view bytes, const T& v) {
+            ++visited;
+            return visit(fn, Traits::from_bytes(bytes), v);
+        };
+        walk_all(sub, path, emit);
+        return visited;
+    }
+    
+    // Longest stored key that is a prefix of key (routing-table lookup),
+    // found in a single walk down key's path
+    iterator longest_prefix_match(std::string_view key) const requires (!is_fixed) {
+        guard_type guard;
+        ReadPath path;
+        for (unsigned attempt = 0;; ++attempt) {
+            path.clear();
+            auto res = attempt < max_read_restarts ? try_longest_prefix(key, path) : locked_longest_prefix(key, path);
+            if (res) {
+                auto [best, len] = *res;
+                return best ? iterator(this, Traits::from_bytes(key.substr(0, len)), *best) : end();
+            }
+            read_restarts_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    
+    size_type count_prefix(std::string_view prefix) const requires (!is_fixed) {
+        guard_type guard;
+        std::string path;
+        const node_type* sub = find_subtree(prefix, path);
+        if (!sub) return 0;
+        size_type n = 0;
+        auto count = [&n](std::string_view, const T&) { ++n; return true; };
+        walk_all(sub, path, count);
+        return n;
+    }
+    
+    // Loads (key, value) pairs sorted by key in one pass, creating each node
+    // once at its final size class with no per-key locking. Input that is
+    // not strictly increasing from some point on, or a trie that already
+    // has entries, falls back to insert(). Not safe alongside other writers.
+    template <std::input_iterator It>
+    void bulk_load(It first, It last) {
+        guard_type guard;
+        std::lock_guard<typename Sync::write_mutex> lock(write_mutex_);
+        if (root_->count == 0 && !root_->has_data()) {
+            bulk_build(first, last);
+            return;
+        }
+        for (; first != last; ++first) {
+            auto&& entry = *first;
+            insert_impl(entry.first, entry.second);
+        }
+    }
     
     std::pair<iterator, bool> insert(const std::pair<const Key, T>& value) {
+        guard_type guard;
+        std::lock_guard<typename Sync::write_mutex> lock(write_mutex_);
         return insert_impl(value.first, value.second);
     }
     
     bool erase(const Key& key) {
-        return erase_impl(key);
+        guard_type guard;
+        std::lock_guard<typename Sync::write_mutex> lock(write_mutex_);
+        return erase_impl(Traits::to_bytes(key));
+    }
+    
+    // Overwriting an existing key's value is one CAS on its node's value
+    // slot, taking no locks; only a new key goes through insert. Returns
+    // true in second when the key was inserted.
+    std::pair<iterator, bool> insert_or_assign(const Key& key, const T& value) {
+        guard_type guard;
+        const auto& kv = Traits::to_bytes(key);
+        while (true) {
+            if (assign_value(kv, [&](const T&) -> const T& { return value; })) return {iterator(this, key, value), false};
+            std::lock_guard<typename Sync::write_mutex> lock(write_mutex_);
+            auto res = insert_impl(key, value);
+            if (res.second) return res;   // else the key appeared meanwhile: assign again
+        }
+    }
+    
+    // Replaces an existing key's value with fn(old value) by CAS, taking no
+    // locks. fn may run more than once when other writers race on the key.
+    // Returns false, without calling fn, when the key is absent.
+    template <typename F>
+    bool update(const Key& key, F&& fn) {
+        guard_type guard;
+        return assign_value(Traits::to_bytes(key), fn);
     }
 
 private:
-    bool contains_impl(std::string_view kv) const {
+    // A point lookup needs no validation: a node never changes once it is
+    // unlinked. In-place edits need its lock, which writers cannot take on an
+    // obsolete node, and the two writes that skip the lock are shut out
+    // before it is copied, child swaps by tagging its child slots and value
+    // CASes by freezing its value slot. A node is only unlinked while locked,
+    // so the node a lookup answers from held that answer at some instant
+    // during the call. longest_prefix_match combines values from every node
+    // on its path, so it records each node's version and value word and
+    // accepts the walk only if none has moved by the end (values are swapped
+    // by CAS without a version bump; a swapped child is itself claimed, so
+    // its version moves): the nodes then all held what was read at one
+    // instant. Conflicts restart the walk, and after max_read_restarts it
+    // locks the path and freezes its values so it cannot be starved.
+    static constexpr unsigned max_read_restarts = 8;
+    struct ReadEntry {
+        node_type* node;
+        uint64_t version;
+        uint64_t data;
+        bool unchanged() const { return node->get_version() == version && node->data.load() == data; }
+    };
+    using ReadPath = PathStack<ReadEntry, 32>;
+    using PrefixMatch = std::optional<std::pair<value_ref, size_t>>;
+    
+    // Walk key's path, calling enter(node, parent, byte) before reading each
+    // node; enter may re-read node from parent, or return false to abandon
+    // the walk
+    template <typename Enter>
+    PrefixMatch prefix_walk(std::string_view key, Enter&& enter) const {
+        std::string_view kv = key;
         node_type* cur = root_;
+        node_type* parent = nullptr;
+        unsigned char c = 0;
+        value_ref best{};
+        size_t best_len = 0;
         while (cur) {
-            if (!cur->skip.empty()) {
-                if (kv.size() < cur->skip.size()) return false;
-                if (kv.substr(0, cur->skip.size()) != cur->skip) return false;
-                kv.remove_prefix(cur->skip.size());
+            if (!enter(cur, parent, c)) return std::nullopt;
+            std::string_view skip = cur->skip;
+            if (!has_prefix(kv, skip)) break;
+            kv.remove_prefix(skip.size());
+            if (auto d = cur->get_data()) {
+                best = d;
+                best_len = key.size() - kv.size();
             }
-            if (kv.empty()) return cur->has_data();
-            cur = cur->get_child((unsigned char)kv[0]);
+            if (kv.empty()) break;
+            parent = cur;
+            c = (unsigned char)kv[0];
+            cur = cur->get_child(c);
             kv.remove_prefix(1);
         }
-        return false;
+        return std::pair{best, best_len};
+    }
+    
+    PrefixMatch try_longest_prefix(std::string_view key, ReadPath& path) const {
+        // Hand-over-hand: entering a node rechecks the one before it
+        auto res = prefix_walk(key, [&](node_type* n, node_type*, unsigned char) {
+            if constexpr (!Sync::shared_readers) return true;
+            if (!path.empty() && !path.back().unchanged()) return false;
+            uint64_t v = n->get_version();
+            path.push_back({n, v, n->data.load()});
+            return node_type::is_stable(v);
+        });
+        if constexpr (Sync::shared_readers) {
+            for (size_t i = 0; res && i < path.size(); ++i)
+                if (!path[i].unchanged()) res.reset();
+        }
+        return res;
+    }
+    
+    // Top-down lock coupling that keeps every lock until the walk ends, with
+    // each value frozen against lock-free assigns and erases. Holding a node
+    // stops it being unlinked, though an insert may still swap its child for
+    // a replacement, so an obsolete child is re-read from the held parent.
+    // Writers only ever try locks, so waiting here cannot deadlock.
+    PrefixMatch locked_longest_prefix(std::string_view key, ReadPath& path) const {
+        PrefixMatch res;
+        if constexpr (!Sync::node_locks) {
+            std::lock_guard<typename Sync::write_mutex> lock(write_mutex_);
+            res = prefix_walk(key, [&](node_type* n, node_type*, unsigned char) {
+                path.push_back({n, 0, n->data.freeze()});
+                return true;
+            });
+        } else {
+            res = prefix_walk(key, [&](node_type*& n, node_type* parent, unsigned char c) {
+                uint64_t v;
+                for (unsigned spin = 0; !n->try_lock(v = n->get_version()); ++spin) {
+                    if (v & node_type::obsolete_bit) n = parent->get_child(c);
+                    backoff(spin);
+                }
+                path.push_back({n, v, n->data.freeze()});
+                return true;
+            });
+        }
+        for (size_t i = 0; i < path.size(); ++i) {
+            if (!value_slot::frozen(path[i].data)) path[i].node->data.thaw();
+            if constexpr (Sync::node_locks) path[i].node->unlock_unchanged(path[i].version);
+        }
+        return res;
+    }
+    
+    // Lookups advance in groups one level at a time. Each next node is
+    // prefetched and only touched a full round later, so the cache misses of
+    // independent keys overlap instead of being paid one after another.
+    static constexpr size_t probe_group = 16;
+    using encoded_key = decltype(Traits::to_bytes(std::declval<const Key&>()));
+    
+    template <typename Done>
+    void probe_many(std::span<const Key> keys, Done&& done) const {
+        guard_type guard;
+        for (size_t base = 0; base < keys.size(); base += probe_group) {
+            size_t n = std::min(probe_group, keys.size() - base);
+            encoded_key enc[probe_group];
+            std::string_view kv[probe_group];
+            FixedCursor fk[probe_group];
+            const node_type* cur[probe_group];
+            for (size_t i = 0; i < n; ++i) {
+                enc[i] = Traits::to_bytes(keys[base + i]);
+                if constexpr (is_fixed) fk[i] = {pack_prefix(enc[i]), fixed_len};
+                else kv[i] = enc[i];
+                cur[i] = root_;
+            }
+            for (size_t active = n; active;) {
+                active = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    const node_type* node = cur[i];
+                    if (!node) continue;
+                    value_ref found{};
+                    const node_type* next;
+                    if constexpr (is_fixed) next = fk[i].step(node, found);
+                    else next = string_step(node, kv[i], found);
+                    if (!next) {
+                        done(base + i, found);
+                        cur[i] = nullptr;
+                        continue;
+                    }
+                    prefetch(next);
+                    cur[i] = next;
+                    ++active;
+                }
+            }
+        }
+    }
+    
+    // FixedCursor::step for a string key's remaining bytes kv
+    static const node_type* string_step(const node_type* cur, std::string_view& kv, value_ref& found) {
+        std::string_view skip = cur->skip;
+        if (!has_prefix(kv, skip)) return nullptr;
+        kv.remove_prefix(skip.size());
+        if (kv.empty()) {
+            found = cur->get_data();
+            return nullptr;
+        }
+        const node_type* next = cur->get_child((unsigned char)kv[0]);
+        kv.remove_prefix(1);
+        return next;
     }
 
-    iterator find_impl(const Key& key, std::string_view kv) const {
+    void collect_stats(const node_type* n, size_t depth, tktrie_stats& st) const {
+        static constexpr size_t capacity[] = {4, 16, 48, 256};
+        static constexpr size_t node_size[] = {sizeof(Node4<T>), sizeof(Node16<T>), sizeof(Node48<T>), sizeof(Node256<T>)};
+        size_t kind = static_cast<size_t>(n->kind), children = 0;
+        n->for_each_child([&](unsigned char, const node_type* c) {
+            ++children;
+            collect_stats(c, depth + 1, st);
+        });
+        ++st.nodes;
+        ++st.nodes_by_kind[kind];
+        if (st.fanout.size() <= children) st.fanout.resize(children + 1);
+        ++st.fanout[children];
+        st.slot_slack += capacity[kind] - children;
+        st.skip_bytes += n->skip.size();
+        st.node_bytes += SlabArena::block_bytes(node_size[kind]);
+        // Skips too long for the string's inline buffer live in their own block
+        auto buf = reinterpret_cast<uintptr_t>(n->skip.data()), self = reinterpret_cast<uintptr_t>(n);
+        if (buf < self || buf >= self + node_size[kind]) st.node_bytes += SlabArena::block_bytes(n->skip.capacity() + 1);
+        if (n->has_data()) {
+            if (st.key_depth.size() <= depth) st.key_depth.resize(depth + 1);
+            ++st.key_depth[depth];
+            if constexpr (!value_slot::is_inline) st.value_bytes += SlabArena::block_bytes(sizeof(T));
+        }
+    }
+
+    // Value of the key with encoding kv, or an empty ref; callers hold an EpochGuard
+    value_ref find_impl(std::string_view kv) const {
         node_type* cur = root_;
         while (cur) {
             if (!cur->skip.empty()) {
-                if (kv.size() < cur->skip.size()) return end();
-                if (kv.substr(0, cur->skip.size()) != cur->skip) return end();
+                if (!has_prefix(kv, cur->skip)) return {};
                 kv.remove_prefix(cur->skip.size());
             }
-            if (kv.empty()) return cur->has_data() ? iterator(key, *cur->data) : end();
+            if (kv.empty()) return cur->get_data();
             cur = cur->get_child((unsigned char)kv[0]);
             kv.remove_prefix(1);
         }
-        return end();
+        return {};
     }
+    
+    // Fixed-length keys stay in one register, next byte lowest, and every
+    // skip is checked with a single masked compare against skip_word. Each
+    // level consumes at least one byte, so there are at most fixed_len + 1.
+    value_ref find_impl(const KeyBytes<fixed_len>& kb) const requires is_fixed {
+        FixedCursor k{pack_prefix(kb), fixed_len};
+        const node_type* cur = root_;
+        value_ref found{};
+        for (size_t level = 0; cur && level <= fixed_len; ++level) cur = k.step(cur, found);
+        return found;
+    }
+    
+    // Unread bytes of a fixed-length key, next byte lowest
+    struct FixedCursor {
+        uint64_t rest;
+        size_t left;
+        // Consume cur's skip and the byte after it; returns the next node, or
+        // nullptr once the walk ends, with found set if the key ends at cur
+        const node_type* step(const node_type* cur, value_ref& found) {
+            if (size_t len = cur->skip.size()) {
+                if (len > left) return nullptr;
+                uint64_t mask = len >= 8 ? ~0ULL : (1ULL << (8 * len)) - 1;
+                if ((rest ^ cur->skip_word) & mask) return nullptr;
+                rest = len >= 8 ? 0 : rest >> (8 * len);
+                left -= len;
+            }
+            if (left == 0) {
+                found = cur->get_data();
+                return nullptr;
+            }
+            const node_type* next = cur->get_child(static_cast<unsigned char>(rest));
+            rest >>= 8;
+            --left;
+            return next;
+        }
+    };
 
-    std::pair<iterator, bool> insert_impl(const Key& key, const T& value) {
-        std::string kv_str;
-        if constexpr (is_fixed) kv_str = Traits::to_bytes(key);
-        else kv_str = std::string(Traits::to_bytes(key));
-        
-        // Phase 1: Optimistic traversal without lock
-        std::vector<PathEntry> path; path.reserve(16);
-        std::string_view kv(kv_str);
-        node_type* cur = root_;
+    // Ordered walks. prefix holds the encoded key walked so far; emit(bytes, value)
+    // returns false to stop, which unwinds the walk (and leaves prefix as is).
+    template <typename Emit>
+    bool walk_all(const node_type* n, std::string& prefix, Emit& emit) const {
+        size_t mark = prefix.size();
+        prefix += n->skip;
+        if (auto d = n->get_data()) {
+            if (!emit(std::string_view(prefix), *d)) return false;
+        }
+        unsigned char c;
+        for (unsigned from = 0; const node_type* child = n->next_child(from, &c); from = c + 1u) {
+            prefix.push_back((char)c);
+            if (!walk_all(child, prefix, emit)) return false;
+            prefix.pop_back();
+        }
+        prefix.resize(mark);
+        return true;
+    }
+    
+    // Like walk_all but only keys after kv (or equal to it when inclusive):
+    // one descent along kv, then whole subtrees to the right of the path
+    template <typename Emit>
+    bool walk_from(const node_type* n, std::string_view kv, bool inclusive, std::string& prefix, Emit& emit) const {
+        std::string_view skip = n->skip;
+        size_t m = std::min(skip.size(), kv.size()), i = common_prefix_len(skip, kv);
+        if (i < m) return (unsigned char)skip[i] > (unsigned char)kv[i] ? walk_all(n, prefix, emit) : true;
+        if (kv.size() < skip.size()) return walk_all(n, prefix, emit);   // every key here extends kv
         
-        while (true) {
-            uint64_t ver = cur->get_version();
-            
-            size_t common = 0;
-            while (common < cur->skip.size() && common < kv.size() && 
-                   cur->skip[common] == kv[common]) ++common;
-            
-            if (common < cur->skip.size()) {
-                // Need to split this node
-                path.push_back({cur, -1, ver});
-                break;
-            }
-            
-            kv.remove_prefix(common);
-            
-            if (kv.empty()) {
-                // Key ends here
-                path.push_back({cur, -1, ver});
-                break;
+        size_t mark = prefix.size();
+        prefix += skip;
+        kv.remove_prefix(skip.size());
+        unsigned from = 0;
+        if (kv.empty()) {
+            if (auto d = inclusive ? n->get_data() : value_ref{}) {
+                if (!emit(std::string_view(prefix), *d)) return false;
             }
-            
+        } else {
             unsigned char c = (unsigned char)kv[0];
-            int idx;
-            if (!cur->get_child_idx(c, &idx)) {
-                // Need to add child
-                path.push_back({cur, -1, ver});
-                break;
+            if (const node_type* child = n->get_child(c)) {
+                prefix.push_back((char)c);
+                if (!walk_from(child, kv.substr(1), inclusive, prefix, emit)) return false;
+                prefix.pop_back();
             }
-            
-            path.push_back({cur, idx, ver});
-            cur = cur->children[idx];
+            from = c + 1u;
+        }
+        unsigned char c;
+        for (; const node_type* child = n->next_child(from, &c); from = c + 1u) {
+            prefix.push_back((char)c);
+            if (!walk_all(child, prefix, emit)) return false;
+            prefix.pop_back();
+        }
+        prefix.resize(mark);
+        return true;
+    }
+    
+    // Shallowest node whose keys all start with kv; path receives the bytes
+    // leading to it (excluding its own skip)
+    const node_type* find_subtree(std::string_view kv, std::string& path) const {
+        const node_type* cur = root_;
+        while (true) {
+            std::string_view skip = cur->skip;
+            size_t m = std::min(skip.size(), kv.size());
+            if (common_prefix_len(kv, skip) < m) return nullptr;
+            if (kv.size() <= skip.size()) return cur;
+            path += skip;
+            kv.remove_prefix(skip.size());
+            cur = cur->get_child((unsigned char)kv[0]);
+            if (!cur) return nullptr;
+            path.push_back(kv[0]);
             kv.remove_prefix(1);
         }
+    }
+    
+    // Visitors may return void or bool (false = stop)
+    template <typename F>
+    static bool visit(F& fn, const Key& key, const T& value) {
+        if constexpr (std::is_same_v<std::invoke_result_t<F&, const Key&, const T&>, bool>) {
+            return fn(key, value);
+        } else {
+            fn(key, value);
+            return true;
+        }
+    }
+    
+    iterator seek_up(std::string_view kv, bool inclusive) const {
+        iterator found = end();
+        auto first = [&](std::string_view bytes, const T& v) {
+            found = iterator(this, Traits::from_bytes(bytes), v);
+            return false;
+        };
+        std::string prefix;
+        walk_from(root_, kv, inclusive, prefix, first);
+        return found;
+    }
+    
+    // Ordered seeks towards smaller keys; prefix is restored on backtrack
+    iterator rightmost(const node_type* n, std::string& prefix) const {
+        size_t mark = prefix.size();
+        prefix += n->skip;
+        unsigned char c;
+        for (int from = 255; const node_type* child = n->prev_child(from, &c); from = c - 1) {
+            prefix.push_back((char)c);
+            iterator it = rightmost(child, prefix);
+            if (it.valid()) return it;
+            prefix.pop_back();
+        }
+        if (auto d = n->get_data()) return iterator(this, Traits::from_bytes(prefix), *d);
+        prefix.resize(mark);
+        return end();
+    }
+    
+    // Largest key before kv (or equal to it when inclusive) under n
+    iterator seek_down(const node_type* n, std::string_view kv, bool inclusive, std::string& prefix) const {
+        std::string_view skip = n->skip;
+        size_t m = std::min(skip.size(), kv.size()), i = common_prefix_len(skip, kv);
+        if (i < m) return (unsigned char)skip[i] < (unsigned char)kv[i] ? rightmost(n, prefix) : end();
+        if (kv.size() < skip.size()) return end();   // every key here extends kv
+        
+        size_t mark = prefix.size();
+        prefix += skip;
+        kv.remove_prefix(skip.size());
+        if (kv.empty()) {
+            if (auto d = inclusive ? n->get_data() : value_ref{}) return iterator(this, Traits::from_bytes(prefix), *d);
+            prefix.resize(mark);
+            return end();
+        }
+        unsigned char c = (unsigned char)kv[0];
+        if (const node_type* child = n->get_child(c)) {
+            prefix.push_back((char)c);
+            iterator it = seek_down(child, kv.substr(1), inclusive, prefix);
+            if (it.valid()) return it;
+            prefix.pop_back();
+        }
+        unsigned char k;
+        for (int from = c - 1; const node_type* child = n->prev_child(from, &k); from = k - 1) {
+            prefix.push_back((char)k);
+            iterator it = rightmost(child, prefix);
+            if (it.valid()) return it;
+            prefix.pop_back();
+        }
+        // n's own key is a proper prefix of kv, so it sorts before it
+        if (auto d = n->get_data()) return iterator(this, Traits::from_bytes(prefix), *d);
+        prefix.resize(mark);
+        return end();
+    }
+    
+    iterator next_after(const Key& key) const { return upper_bound(key); }
+    iterator prev_before(const Key& key) const {
+        guard_type guard;
+        const auto& kv = Traits::to_bytes(key);
+        std::string prefix;
+        return seek_down(root_, kv, false, prefix);
+    }
+    iterator last() const {
+        guard_type guard;
+        std::string prefix;
+        return rightmost(root_, prefix);
+    }
+
+    // Single-pass bottom-up build from sorted input. The stack holds the
+    // rightmost path of the trie built so far; every entry is a prefix of the
+    // previous key and owns the tail of `children` from child_begin. When a
+    // key diverges from the previous one, entries deeper than their common
+    // prefix are finished into nodes of their final size class.
+    struct BulkEntry {
+        size_t end;           // length of the key prefix this entry stands for
+        size_t child_begin;   // first of its children in the shared child stack
+        typename value_slot::owned data;
+    };
+    
+    template <typename It>
+    void bulk_build(It first, It last) {
+        std::vector<BulkEntry> stack{{0, 0, {}}};
+        std::vector<std::pair<unsigned char, node_type*>> children;
+        std::string prev;
+        size_type loaded = 0;
         
-        // Phase 2: Acquire lock
-        std::lock_guard<std::mutex> lock(write_mutex_);
+        // Finish every entry deeper than l, adding a branch entry at l if needed
+        auto unwind = [&](size_t l) {
+            while (stack.back().end > l) {
+                BulkEntry e = stack.back();
+                stack.pop_back();
+                // A branch entry at l adopts e, whose node lands at e.child_begin
+                if (stack.back().end < l) stack.push_back({l, e.child_begin, {}});
+                size_t start = stack.back().end + 1;
+                node_type* n = node_type::make(node_type::size_class(unsigned(children.size() - e.child_begin)), arena_);
+                n->set_skip(std::string_view(prev).substr(start, e.end - start));
+                n->data.adopt(e.data);
+                for (size_t i = e.child_begin; i < children.size(); ++i) n->add_child(children[i].first, children[i].second);
+                children.resize(e.child_begin);
+                children.push_back({(unsigned char)prev[start - 1], n});
+            }
+        };
         
-        // Phase 3: Check if path is still valid
-        if (!path_valid(path)) {
-            // Path changed, redo under lock (but we're already locked, so it's safe)
+        for (; first != last; ++first) {
+            auto&& entry = *first;
+            const auto& enc = Traits::to_bytes(entry.first);
+            std::string_view kv(enc);
+            if (loaded && !(std::string_view(prev) < kv)) break;   // not strictly increasing
+            size_t l = 0;
+            while (l < prev.size() && l < kv.size() && prev[l] == kv[l]) ++l;
+            unwind(l);
+            auto data = value_slot::make(entry.second, arena_);
+            if (kv.empty()) root_->data.adopt(data);
+            else stack.push_back({kv.size(), children.size(), data});
+            prev.assign(kv);
+            ++loaded;
         }
+        unwind(0);
         
-        // Phase 4: Execute insert (under lock, so safe to modify in place)
-        return do_insert(key, value, kv_str);
+        // Publishing into the root makes the finished subtrees visible to readers
+        for (auto& [c, n] : children) root_->add_child(c, n);
+        elem_count_.fetch_add(loaded, std::memory_order_relaxed);
+        for (; first != last; ++first) {
+            auto&& entry = *first;
+            insert_impl(entry.first, entry.second);
+        }
+    }
+
+    std::pair<iterator, bool> insert_impl(const Key& key, const T& value) {
+        const auto& kv = Traits::to_bytes(key);
+        Path path;
+        for (unsigned attempt = 0;; ++attempt) {
+            if (auto res = try_insert(key, value, kv, path)) return *res;
+            write_restarts_.fetch_add(1, std::memory_order_relaxed);
+            backoff(attempt);
+        }
     }
     
-    std::pair<iterator, bool> do_insert(const Key& key, const T& value, const std::string& kv_str) {
-        std::string_view kv(kv_str);
-        node_type* cur = root_;
+    // Where an attempt starts: the root, or the deepest node a failed attempt
+    // recorded that no writer has touched since. Each kept node still holds
+    // what was read from it and still hangs off the kept node above, so the
+    // walk carries on from there without re-reading the path.
+    std::pair<node_type*, uint64_t> resume(Path& path, std::string_view& kv) const {
+        size_t keep = 0;
+        while (keep < path.size() && path[keep].node->get_version() == path[keep].version) ++keep;
+        path.resize(keep);
+        if (path.empty()) return {root_, root_->get_version()};
+        PathEntry e = path.back();
+        path.pop_back();
+        kv.remove_prefix(e.key_pos);
+        return {e.node, e.version};
+    }
+    
+    // One optimistic attempt: walk without locks, recording versions, then
+    // lock only the node being modified, or claim it when it is replaced.
+    // Returns nullopt when a version moved underneath us and we must restart.
+    std::optional<std::pair<iterator, bool>> try_insert(const Key& key, const T& value,
+                                                        std::string_view kv, Path& path) {
+        const std::string_view full = kv;
+        const size_t key_len = kv.size();
+        auto [cur, ver] = resume(path, kv);
+        if (!node_type::is_stable(ver)) return std::nullopt;
         
         while (true) {
-            size_t common = 0;
-            while (common < cur->skip.size() && common < kv.size() && 
-                   cur->skip[common] == kv[common]) ++common;
+            const uint32_t at = uint32_t(key_len - kv.size());
+            size_t common = common_prefix_len(cur->skip, kv);
             
             if (common < cur->skip.size()) {
-                // Split node
-                node_type* old_suffix = new node_type();
-                old_suffix->skip = cur->skip.substr(common + 1);
-                old_suffix->data = std::move(cur->data);
-                old_suffix->pop = cur->pop;
-                old_suffix->children = std::move(cur->children);
-                
-                unsigned char old_char = cur->skip[common];  // Character that goes to old_suffix
-                cur->skip.resize(common);
-                cur->pop = PopCount{};
-                cur->children.clear();
-                
-                if (common == kv.size()) {
-                    // Key ends at split point
-                    cur->set_data(value);
-                    int idx = cur->pop.set(old_char);
-                    cur->children.insert(cur->children.begin() + idx, old_suffix);
-                } else {
-                    // Key continues past split
-                    cur->data.reset();
-                    node_type* new_child = new node_type();
-                    new_child->skip = std::string(kv.substr(common + 1));
-                    new_child->set_data(value);
+                // Split node: a new Node4 takes the shared prefix above a copy
+                // of cur holding the rest of its skip
+                bool replaced = replace_node(path, cur, ver, full, at, [&] {
+                    std::string_view skip = cur->skip;
+                    node_type* split = node_type::make(NodeKind::N4, arena_);
+                    split->set_skip(skip.substr(0, common));
+                    unsigned char old_char = skip[common];  // Character that goes to the copy
+                    split->add_child(old_char, cur->copy_as(cur->kind, skip.substr(common + 1)));
                     
-                    unsigned char new_char = (unsigned char)kv[common];
-                    if (old_char < new_char) {
-                        cur->pop.set(old_char); cur->pop.set(new_char);
-                        cur->children.push_back(old_suffix);
-                        cur->children.push_back(new_child);
+                    if (common == kv.size()) {
+                        // Key ends at split point
+                        split->set_data(value);
                     } else {
-                        cur->pop.set(new_char); cur->pop.set(old_char);
-                        cur->children.push_back(new_child);
-                        cur->children.push_back(old_suffix);
+                        // Key continues past split
+                        split->add_child((unsigned char)kv[common], make_leaf(kv.substr(common + 1), value));
                     }
-                }
-                
-                cur->inc_version();
+                    return split;
+                });
+                if (!replaced) return std::nullopt;
                 elem_count_.fetch_add(1, std::memory_order_relaxed);
-                return {iterator(key, value), true};
+                return std::pair{iterator(this, key, value), true};
             }
             
             kv.remove_prefix(common);
             
             if (kv.empty()) {
                 // Key ends at this node
-                if (cur->has_data()) return {iterator(key, *cur->data), false};
+                if (!try_lock(cur, ver)) return std::nullopt;
+                if (auto d = cur->get_data()) {
+                    iterator existing(this, key, *d);
+                    unlock(cur);
+                    return std::pair{existing, false};
+                }
                 cur->set_data(value);
-                cur->inc_version();
+                unlock(cur);
                 elem_count_.fetch_add(1, std::memory_order_relaxed);
-                return {iterator(key, value), true};
+                return std::pair{iterator(this, key, value), true};
             }
             
             unsigned char c = (unsigned char)kv[0];
-            int idx;
-            if (!cur->get_child_idx(c, &idx)) {
-                // Add new child
-                node_type* child = new node_type();
-                child->skip = std::string(kv.substr(1));
-                child->set_data(value);
-                idx = cur->pop.set(c);
-                cur->children.insert(cur->children.begin() + idx, child);
-                cur->inc_version();
+            node_type* next = cur->get_child(c);
+            if (!next) {
+                if (cur->child_ref(c)) {
+                    // c still has a slot (any Node256 byte, or a removed
+                    // child's): fill it with one atomic store
+                    if (!try_lock(cur, ver)) return std::nullopt;
+                    cur->add_child(c, make_leaf(kv.substr(1), value));
+                    unlock(cur);
+                } else {
+                    // Otherwise publish a copy with the new child, a size class up if full
+                    if (!replace_node(path, cur, ver, full, at, [&] { return cur->with_child(c, make_leaf(kv.substr(1), value)); }))
+                        return std::nullopt;
+                }
                 elem_count_.fetch_add(1, std::memory_order_relaxed);
-                return {iterator(key, value), true};
+                return std::pair{iterator(this, key, value), true};
             }
             
-            cur = cur->children[idx];
+            // Hand-over-hand: next is only trustworthy if cur did not change
+            // meanwhile. A claimed next is swapped for its successor first.
+            uint64_t next_ver = next->get_version();
+            if (cur->get_version() != ver || !node_type::is_stable(next_ver)) {
+                help_replace(cur, c, next);
+                return std::nullopt;
+            }
+            path.push_back({cur, c, at, ver});
+            cur = next;
+            ver = next_ver;
             kv.remove_prefix(1);
         }
     }
-
-    bool erase_impl(const Key& key) {
-        std::string kv_str;
-        if constexpr (is_fixed) kv_str = Traits::to_bytes(key);
-        else kv_str = std::string(Traits::to_bytes(key));
-        
-        // Phase 1: Optimistic traversal
-        std::vector<PathEntry> path; path.reserve(16);
-        std::string_view kv(kv_str);
+    
+    // Replace cur, read at version ver and starting at key position at, with
+    // the node build() returns. Under sync_concurrent the parent is never
+    // locked, so writers below different children of one node do not
+    // contend: locking cur claims it for good, its child slots are frozen
+    // while build() copies them, and the successor is published in
+    // cur->replacement before being swapped into the parent's slot by CAS.
+    // That CAS fails only while the parent is itself being copied. cur then
+    // waits, claimed, in the parent's successor, and whoever meets it next
+    // finishes the swap: another writer passing by, or this thread, which
+    // finds the parent again and retries until cur has been replaced.
+    template <typename Build>
+    bool replace_node(Path& path, node_type* cur, uint64_t ver, std::string_view key, uint32_t at, Build&& build) {
+        if constexpr (!Sync::node_locks) {
+            PathEntry& parent = path.back();
+            if (!lock_with_parent(parent, cur, ver)) return false;
+            freeze(cur);
+            replace_locked(parent, cur, build());
+        } else {
+            if (!try_lock(cur, ver)) return false;
+            freeze(cur);
+            cur->replacement.store(build(), std::memory_order_release);
+            const unsigned char c = static_cast<unsigned char>(key[at - 1]);
+            node_type* parent = path.back().node;
+            for (unsigned attempt = 0; !help_replace(parent, c, cur); ++attempt) {
+                if (cur->get_version() & node_type::obsolete_bit) break;   // a helper swapped it in
+                backoff(attempt);
+                parent = find_parent(key, at);
+            }
+        }
+        return true;
+    }
+    
+    // Swap n, if claimed with its successor built, for that successor in
+    // parent's slot c. Only the one CAS that succeeds retires n.
+    bool help_replace(node_type* parent, unsigned char c, node_type* n) {
+        if constexpr (!Sync::node_locks) return false;
+        node_type* r = n->replacement.load(std::memory_order_acquire);
+        auto* slot = r && parent ? parent->child_ref(c) : nullptr;
+        node_type* expected = n;
+        if (!slot || !slot->compare_exchange_strong(expected, r, std::memory_order_acq_rel, std::memory_order_relaxed)) return false;
+        n->unlock_obsolete();
+        retire_node(n);
+        return true;
+    }
+    
+    // The node whose slot key[at - 1] holds the node starting at key position
+    // at, or nullptr when the path is in flux; a claimed node met on the way
+    // is helped into place first
+    node_type* find_parent(std::string_view key, uint32_t at) {
+        node_type* parent = nullptr;
         node_type* cur = root_;
-        
+        size_t pos = 0;
         while (cur) {
-            uint64_t ver = cur->get_version();
-            
+            if (parent && !node_type::is_stable(cur->get_version())) {
+                help_replace(parent, static_cast<unsigned char>(key[pos - 1]), cur);
+                return nullptr;
+            }
+            pos += cur->skip.size();
+            if (pos + 1 >= at) return pos + 1 == at ? cur : nullptr;
+            parent = cur;
+            cur = cur->get_child(static_cast<unsigned char>(key[pos]));
+            ++pos;
+        }
+        return nullptr;
+    }
+    
+    bool lock_with_parent(PathEntry& parent, node_type* cur, uint64_t ver) {
+        if (!try_lock(parent.node, parent.version)) return false;
+        if (!try_lock(cur, ver)) { unlock(parent.node); return false; }
+        return true;
+    }
+    
+    // Swap a locked node for its replacement in the (locked) parent slot
+    void replace_locked(PathEntry& parent, node_type* cur, node_type* replacement) {
+        parent.node->child_ref((unsigned char)parent.child_idx)->store(replacement, std::memory_order_release);
+        unlock_obsolete(cur);
+        unlock(parent.node);
+        retire_node(cur);
+    }
+    
+    node_type* make_leaf(std::string_view rest, const T& value) {
+        node_type* leaf = node_type::make(NodeKind::N4, arena_);
+        leaf->set_skip(rest);
+        leaf->set_data(value);
+        return leaf;
+    }
+
+    bool erase_impl(std::string_view kv) {
+        Path path;
+        for (unsigned attempt = 0;; ++attempt) {
+            if (auto res = try_erase(kv, path)) return *res;
+            write_restarts_.fetch_add(1, std::memory_order_relaxed);
+            backoff(attempt);
+        }
+    }
+    
+    std::optional<bool> try_erase(std::string_view kv, Path& path) {
+        const size_t key_len = kv.size();
+        auto [cur, ver] = resume(path, kv);
+        if (!node_type::is_stable(ver)) return std::nullopt;
+        
+        while (true) {
+            const uint32_t at = uint32_t(key_len - kv.size());
             if (!cur->skip.empty()) {
-                if (kv.size() < cur->skip.size()) return false;
-                if (kv.substr(0, cur->skip.size()) != cur->skip) return false;
+                if (!has_prefix(kv, cur->skip)) {
+                    if (cur->get_version() != ver) return std::nullopt;
+                    return false;
+                }
                 kv.remove_prefix(cur->skip.size());
             }
             
             if (kv.empty()) {
-                path.push_back({cur, -1, ver});
-                break;
+                if (keeps_shape_without_value(cur)) return take_value(cur);
+                if (!cur->has_data()) {
+                    if (cur->get_version() != ver) return std::nullopt;
+                    return false;
+                }
+                return unlink_data(cur, ver, path);
             }
             
             unsigned char c = (unsigned char)kv[0];
-            int idx;
-            if (!cur->get_child_idx(c, &idx)) return false;
-            
-            path.push_back({cur, idx, ver});
-            cur = cur->children[idx];
+            node_type* next = cur->get_child(c);
+            if (!next) {
+                if (cur->get_version() != ver) return std::nullopt;
+                return false;
+            }
+            uint64_t next_ver = next->get_version();
+            if (cur->get_version() != ver || !node_type::is_stable(next_ver)) {
+                help_replace(cur, c, next);
+                return std::nullopt;
+            }
+            path.push_back({cur, c, at, ver});
+            cur = next;
+            ver = next_ver;
             kv.remove_prefix(1);
         }
-        
-        if (!cur) return false;
-        
-        // Phase 2: Lock and verify
-        std::lock_guard<std::mutex> lock(write_mutex_);
-        
-        if (!path_valid(path)) {
-            // Redo under lock
-            return do_erase(kv_str);
-        }
-        
-        // Phase 3: Execute
-        if (!cur->has_data()) return false;
-        cur->clear_data();
-        cur->inc_version();
-        elem_count_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    
+    // The root, and nodes with two or more children, stay valid without a
+    // value. Children are only removed in place while at least two remain,
+    // so a published node's count never drops below two that way.
+    bool keeps_shape_without_value(const node_type* n) const {
+        return n == root_ || n->count >= 2;
+    }
+    
+    // Erase from such a node is one CAS emptying its value slot
+    std::optional<bool> take_value(node_type* n) {
+        uint64_t w = n->data.load();
+        do {
+            if (value_slot::frozen(w)) return std::nullopt;
+            if (!value_slot::present(w)) return false;
+        } while (!swap_data(n, w, 0));
+        finish_erase(value_slot::decode(w));
         return true;
     }
     
-    bool do_erase(const std::string& kv_str) {
-        std::string_view kv(kv_str);
+    // Node where the encoded key ends, if it has one; callers hold an EpochGuard
+    node_type* find_node(std::string_view kv) const {
         node_type* cur = root_;
-        
         while (cur) {
-            if (!cur->skip.empty()) {
-                if (kv.size() < cur->skip.size()) return false;
-                if (kv.substr(0, cur->skip.size()) != cur->skip) return false;
-                kv.remove_prefix(cur->skip.size());
+            if (!has_prefix(kv, cur->skip)) return nullptr;
+            kv.remove_prefix(cur->skip.size());
+            if (kv.empty()) return cur;
+            cur = cur->get_child((unsigned char)kv[0]);
+            kv.remove_prefix(1);
+        }
+        return nullptr;
+    }
+    
+    // Swap an existing value for fn(value) with a CAS on its slot. A value
+    // present and unfrozen means the node is linked, so a successful CAS is
+    // the update's linearization point; a frozen slot means the node is
+    // being replaced, and the walk is repeated to find its replacement.
+    template <typename F>
+    bool assign_value(std::string_view kv, F&& fn) {
+        for (unsigned attempt = 0;; ++attempt) {
+            node_type* n = find_node(kv);
+            if (!n) return false;
+            uint64_t w = n->data.load();
+            while (!value_slot::frozen(w)) {
+                if (!value_slot::present(w)) return false;
+                auto fresh = value_slot::make(fn(*value_slot::view(w)), arena_);
+                if (swap_data(n, w, value_slot::encode(fresh))) {
+                    retire_data(value_slot::decode(w));
+                    return true;
+                }
+                free_value(fresh);
             }
-            
-            if (kv.empty()) {
-                if (!cur->has_data()) return false;
-                cur->clear_data();
-                cur->inc_version();
-                elem_count_.fetch_sub(1, std::memory_order_relaxed);
-                return true;
+            write_restarts_.fetch_add(1, std::memory_order_relaxed);
+            backoff(attempt);
+        }
+    }
+    
+    // Take the value of cur, a leaf or a node with one child, and keep the
+    // trie compressed: every node below the root holds a value or at least
+    // two children. An emptied leaf leaves its parent (which may in turn fuse
+    // with its last child), and a value-less node with one child is fused
+    // into that child. Locks are only ever tried, never waited on, so taking
+    // them bottom-up cannot deadlock, and child counts are read once the
+    // node is locked.
+    std::optional<bool> unlink_data(node_type* cur, uint64_t ver, Path& path) {
+        if (!try_lock(cur, ver)) return std::nullopt;
+        PathEntry& parent = path.back();
+        node_type* p = parent.node;
+        if (!try_lock(p, parent.version)) { unlock_all(cur); return std::nullopt; }
+        if (cur->count == 1) {
+            unsigned char c = 0;
+            node_type* child = cur->next_child(0, &c);
+            if (!try_lock(child, child->get_version())) { unlock_all(p, cur); return std::nullopt; }
+            finish_erase(take_data(cur));
+            freeze(child);
+            replace_locked(parent, cur, cur->fused_with(c, child));
+            retire_locked(child);
+            return true;
+        }
+        
+        // cur is an emptied leaf. p drops it with one atomic store, the way a
+        // removed key is refilled, until p is due to shrink a size class
+        if (p == root_ || p->count > shrink_below(p->kind)) {
+            finish_erase(take_data(cur));
+            p->remove_child((unsigned char)parent.child_idx);
+            unlock(p);
+            retire_locked(cur);
+            return true;
+        }
+        
+        PathEntry& grand = path[path.size() - 2];
+        if (!try_lock(grand.node, grand.version)) { unlock_all(p, cur); return std::nullopt; }
+        // Freeze p's value before reading it, so a lock-free erase cannot
+        // empty it between this choice and the copy
+        if (p->count == 2 && !value_slot::present(freeze_data(p))) {
+            // p would be left value-less with one child: fuse it with the survivor
+            unsigned char oc = 0;
+            node_type* other = p->next_child(0, &oc);
+            if (oc == (unsigned char)parent.child_idx) other = p->next_child(oc + 1u, &oc);
+            if (!try_lock(other, other->get_version())) {
+                thaw_data(p);
+                unlock_all(grand.node, p, cur);
+                return std::nullopt;
             }
-            
-            unsigned char c = (unsigned char)kv[0];
-            int idx;
-            if (!cur->get_child_idx(c, &idx)) return false;
-            cur = cur->children[idx];
-            kv.remove_prefix(1);
+            finish_erase(take_data(cur));
+            freeze(other);
+            replace_locked(grand, p, p->fused_with(oc, other));
+            retire_locked(cur);
+            retire_locked(other);
+            return true;
+        }
+        finish_erase(take_data(cur));
+        freeze(p);
+        replace_locked(grand, p, p->without_child((unsigned char)parent.child_idx));
+        retire_locked(cur);
+        return true;
+    }
+    
+    // Live children at which removal copies p into a smaller node instead.
+    // Each is at least two, and well under the smaller class's capacity so
+    // a node hovering at a boundary is not copied back and forth.
+    static unsigned shrink_below(NodeKind k) {
+        switch (k) {
+        case NodeKind::N4: return 2;
+        case NodeKind::N16: return 3;
+        case NodeKind::N48: return 12;
+        case NodeKind::N256: return 37;
+        }
+        return 2;
+    }
+    
+    void finish_erase(typename value_slot::owned old) {
+        retire_data(old);
+        elem_count_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    
+    template <typename... N> static void unlock_all(N*... n) { (unlock(n), ...); }
+    
+    // Inserts swap a node's children by CAS, and value writers its value,
+    // without locking it, so a locked node is frozen before it is copied
+    static void freeze(node_type* n) {
+        if constexpr (Sync::node_locks) n->freeze_children();
+        freeze_data(n);
+    }
+    
+    // Value slots are only frozen and swapped atomically when other threads
+    // can be inside the trie; a single-threaded trie reads and writes them
+    static uint64_t freeze_data(node_type* n) {
+        if constexpr (Sync::shared_readers) return n->data.freeze();
+        else return n->data.load();
+    }
+    static void thaw_data(node_type* n) {
+        if constexpr (Sync::shared_readers) n->data.thaw();
+    }
+    static typename value_slot::owned take_data(node_type* n) {
+        if constexpr (Sync::shared_readers) {
+            return n->data.take();
+        } else {
+            uint64_t w = n->data.load();
+            n->data.set(0);
+            return value_slot::decode(w);
         }
-        return false;
+    }
+    static bool swap_data(node_type* n, uint64_t& expected, uint64_t desired) {
+        if constexpr (Sync::shared_readers) {
+            return n->data.cas(expected, desired);
+        } else {
+            n->data.set(desired);   // expected was just loaded and nothing else writes
+            return true;
+        }
+    }
+    
+    // Mark a locked node that has been unlinked and hand it to the retire list
+    void retire_locked(node_type* n) {
+        unlock_obsolete(n);
+        retire_node(n);
     }
 };
 
+template <typename Key, typename T, typename Allocator, typename Sync>
+tktrie_iterator<Key, T, Allocator, Sync>& tktrie_iterator<Key, T, Allocator, Sync>::operator++() {
+    if (valid_) *this = trie_->next_after(key_);
+    return *this;
+}
+
+template <typename Key, typename T, typename Allocator, typename Sync>
+tktrie_iterator<Key, T, Allocator, Sync>& tktrie_iterator<Key, T, Allocator, Sync>::operator--() {
+    if (trie_) *this = valid_ ? trie_->prev_before(key_) : trie_->last();
+    return *this;
+}
+
 } // namespace gteitelbaum